@@ -0,0 +1,223 @@
+#include "api_json.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static void writeRaw(JsonWriter& json, const char* data, size_t length) {
+  writeHttpResponse(*json.response, *json.connection, (const uint8_t*)data, length);
+}
+
+// Quotes value, escaping what JSON does not allow inside a string
+static void writeQuoted(JsonWriter& json, const char* value) {
+  writeRaw(json, "\"", 1);
+  const char* run = value;
+  for (const char* at = value;; at++) {
+    unsigned char c = *at;
+    if (c != 0 && c != '"' && c != '\\' && c >= 0x20) {
+      continue;
+    }
+    writeRaw(json, run, at - run);
+    if (c == 0) {
+      break;
+    }
+    char escape[8];
+    int length = c == '"' || c == '\\' ? snprintf(escape, sizeof(escape), "\\%c", c)
+                                       : snprintf(escape, sizeof(escape), "\\u%04x", c);
+    writeRaw(json, escape, length);
+    run = at + 1;
+  }
+  writeRaw(json, "\"", 1);
+}
+
+// Separator and key before a member
+static void writeKey(JsonWriter& json, const char* key) {
+  if (json.depth > 0) {
+    if (json.hasMembers[json.depth - 1]) {
+      writeRaw(json, ",", 1);
+    }
+    json.hasMembers[json.depth - 1] = true;
+  }
+  if (key != NULL) {
+    writeQuoted(json, key);
+    writeRaw(json, ":", 1);
+  }
+}
+
+static void openLevel(JsonWriter& json, const char* key, char opener, char closer) {
+  if (json.depth == jsonMaxDepth) {
+    return;
+  }
+  writeKey(json, key);
+  writeRaw(json, &opener, 1);
+  json.closers[json.depth] = closer;
+  json.hasMembers[json.depth] = false;
+  json.depth++;
+}
+
+void startJson(JsonWriter& json, HttpResponse& response, HttpConnection& connection) {
+  json.response = &response;
+  json.connection = &connection;
+  json.depth = 0;
+}
+
+void finishJson(JsonWriter& json) {
+  while (json.depth > 0) {
+    jsonEnd(json);
+  }
+  sendHttpResponse(*json.response, *json.connection);
+}
+
+void jsonObject(JsonWriter& json, const char* key) {
+  openLevel(json, key, '{', '}');
+}
+
+void jsonArray(JsonWriter& json, const char* key) {
+  openLevel(json, key, '[', ']');
+}
+
+void jsonEnd(JsonWriter& json) {
+  if (json.depth > 0) {
+    json.depth--;
+    writeRaw(json, &json.closers[json.depth], 1);
+  }
+}
+
+void jsonString(JsonWriter& json, const char* key, const char* value) {
+  writeKey(json, key);
+  if (value == NULL) {
+    writeRaw(json, "null", 4);
+  } else {
+    writeQuoted(json, value);
+  }
+}
+
+void jsonUint(JsonWriter& json, const char* key, uint64_t value) {
+  char number[24];
+  int length = snprintf(number, sizeof(number), "%llu", (unsigned long long)value);
+  writeKey(json, key);
+  writeRaw(json, number, length);
+}
+
+void jsonBool(JsonWriter& json, const char* key, bool value) {
+  writeKey(json, key);
+  writeRaw(json, value ? "true" : "false", value ? 4 : 5);
+}
+
+void jsonFloat(JsonWriter& json, const char* key, double value) {
+  char number[32];
+  int length = snprintf(number, sizeof(number), "%.2f", value);
+  writeKey(json, key);
+  writeRaw(json, number, length);
+}
+
+void writeErrorJson(JsonWriter& json, const char* message) {
+  jsonObject(json, NULL);
+  jsonString(json, "status", "error");
+  jsonString(json, "message", message);
+  jsonEnd(json);
+}
+
+void writeTimerJson(JsonWriter& json, const char* message, const char* timer, uint32_t durationSeconds,
+                    uint32_t remainingSeconds) {
+  jsonObject(json, NULL);
+  jsonString(json, "status", "success");
+  if (message != NULL) {
+    jsonString(json, "message", message);
+  }
+  jsonString(json, "timer", timer);
+  jsonUint(json, "duration", durationSeconds);
+  jsonUint(json, "remaining", remainingSeconds);
+  jsonEnd(json);
+}
+
+void writeLightsJson(JsonWriter& json, const char* message, const char* red, const char* green) {
+  jsonObject(json, NULL);
+  jsonString(json, "status", "success");
+  if (message != NULL) {
+    jsonString(json, "message", message);
+  }
+  jsonObject(json, "lights");
+  jsonString(json, "red light", red);
+  jsonString(json, "green light", green);
+  jsonEnd(json);
+  jsonEnd(json);
+}
+
+static void writeShoppingItemJson(JsonWriter& json, const ShoppingItem& item) {
+  jsonObject(json, NULL);
+  jsonString(json, "id", item.id);
+  jsonString(json, "text", item.text);
+  jsonBool(json, "completed", item.completed);
+  jsonBool(json, "deleted", item.deleted);
+  jsonUint(json, "ts", item.timestamp);
+  jsonUint(json, "replica", item.replica);
+  jsonEnd(json);
+}
+
+void writeShoppingJson(JsonWriter& json, const ShoppingStore& store, uint32_t epoch, uint32_t since, int rejected) {
+  bool delta = epoch == store.epoch && since <= store.seq;
+  jsonObject(json, NULL);
+  jsonString(json, "status", "success");
+  jsonUint(json, "epoch", store.epoch);
+  jsonUint(json, "seq", store.seq);
+  jsonBool(json, "full", !delta);
+  jsonArray(json, "items");
+  for (int i = 0; i < store.itemCount; i++) {
+    const ShoppingItem& item = store.items[i];
+    if (delta ? item.seq > since : !item.deleted) {
+      writeShoppingItemJson(json, item);
+    }
+  }
+  jsonEnd(json);
+  if (rejected >= 0) {
+    jsonUint(json, "rejected", rejected);
+  }
+  jsonEnd(json);
+}
+
+void writeShoppingChangeJson(JsonWriter& json, const ShoppingStore& store, const ShoppingItem& item) {
+  jsonObject(json, NULL);
+  jsonString(json, "status", "success");
+  jsonUint(json, "seq", store.seq);
+  jsonArray(json, "items");
+  writeShoppingItemJson(json, item);
+  jsonEnd(json);
+  jsonEnd(json);
+}
+
+void writeHistoryStatsJson(JsonWriter& json, const History& history, uint32_t droppedNoClock) {
+  jsonObject(json, "history");
+  jsonUint(json, "records", history.records);
+  jsonUint(json, "droppedNoClock", droppedNoClock);
+  jsonUint(json, "inlineErases", history.inlineErases);
+  jsonEnd(json);
+}
+
+void writeShoppingStatsJson(JsonWriter& json, const ShoppingStore& store, uint32_t upstreamBatches,
+                            uint32_t upstreamFailures) {
+  jsonObject(json, "shopping");
+  jsonUint(json, "items", store.itemCount);
+  jsonUint(json, "logRecords", store.logRecords);
+  jsonUint(json, "logFailures", store.logFailures);
+  jsonUint(json, "upstreamBatches", upstreamBatches);
+  jsonUint(json, "upstreamFailures", upstreamFailures);
+  jsonEnd(json);
+}
+
+void writeRouteStatsJson(JsonWriter& json, const RouteStats* routes, int count) {
+  jsonArray(json, "routes");
+  for (int i = 0; i < count; i++) {
+    const RouteStats& route = routes[i];
+    if (route.requests == 0) {
+      continue;
+    }
+    jsonObject(json, NULL);
+    jsonString(json, "route", route.prefix[0] ? route.prefix : "other");
+    jsonUint(json, "requests", route.requests);
+    jsonUint(json, "allocations", route.allocations);
+    jsonUint(json, "allocatedBytes", route.allocatedBytes);
+    jsonUint(json, "maxAllocations", route.maxAllocations);
+    jsonEnd(json);
+  }
+  jsonEnd(json);
+}
@@ -0,0 +1,61 @@
+// JSON bodies of the API's answers, written member by member straight into
+// the response buffer and sent a TCP segment at a time, so no document is
+// built and nothing allocates. The timer, lights, error and shopping answers
+// and the stats sections drawn from host modules are built here; the request
+// path soak drives them (see test/test_http_request.cpp).
+#ifndef API_JSON_H
+#define API_JSON_H
+
+#include <stdint.h>
+
+#include "history.h"
+#include "http_request.h"
+#include "shopping_store.h"
+
+const int jsonMaxDepth = 6;
+
+struct JsonWriter {
+  HttpResponse* response;
+  HttpConnection* connection;
+  int depth;
+  char closers[jsonMaxDepth];    // '}' or ']' for each open level
+  bool hasMembers[jsonMaxDepth]; // The next member at this level needs a comma
+};
+
+// Readies json to write after whatever the response already holds (the
+// status line and headers)
+void startJson(JsonWriter& json, HttpResponse& response, HttpConnection& connection);
+// Closes anything left open and sends what is buffered
+void finishJson(JsonWriter& json);
+
+// Opens an object or array; key is NULL for the root and inside arrays
+void jsonObject(JsonWriter& json, const char* key);
+void jsonArray(JsonWriter& json, const char* key);
+void jsonEnd(JsonWriter& json);
+// Members; key is NULL inside arrays. A NULL string is written as null.
+void jsonString(JsonWriter& json, const char* key, const char* value);
+void jsonUint(JsonWriter& json, const char* key, uint64_t value);
+void jsonBool(JsonWriter& json, const char* key, bool value);
+void jsonFloat(JsonWriter& json, const char* key, double value); // Two decimals
+
+void writeErrorJson(JsonWriter& json, const char* message);
+// Timer routes share one shape; message may be NULL
+void writeTimerJson(JsonWriter& json, const char* message, const char* timer, uint32_t durationSeconds,
+                    uint32_t remainingSeconds);
+// Light routes share one shape; message may be NULL
+void writeLightsJson(JsonWriter& json, const char* message, const char* red, const char* green);
+
+// The whole list, or only what changed after `since` when the caller's epoch
+// matches the store's. rejected is left out when negative.
+void writeShoppingJson(JsonWriter& json, const ShoppingStore& store, uint32_t epoch, uint32_t since, int rejected);
+// Answer to a single change: the store's seq and the item as it now stands
+void writeShoppingChangeJson(JsonWriter& json, const ShoppingStore& store, const ShoppingItem& item);
+
+// Sections of /api/stats
+void writeHistoryStatsJson(JsonWriter& json, const History& history, uint32_t droppedNoClock);
+void writeShoppingStatsJson(JsonWriter& json, const ShoppingStore& store, uint32_t upstreamBatches,
+                            uint32_t upstreamFailures);
+// Routes that have served a request, with the heap use charged to them
+void writeRouteStatsJson(JsonWriter& json, const RouteStats* routes, int count);
+
+#endif
@@ -1,4 +1,4 @@
-import React, { useState, useEffect } from "react";
+import React, { useState, useEffect, useRef } from "react";
 import {
   View,
   Text,
@@ -6,93 +6,188 @@ import {
   TouchableOpacity,
   FlatList,
   StyleSheet,
-  Alert,
 } from "react-native";
-import {
-  collection,
-  addDoc,
-  onSnapshot,
-  updateDoc,
-  deleteDoc,
-  doc,
-  serverTimestamp,
-} from "firebase/firestore";
-import { db } from "../config/firebase";
+import AsyncStorage from "@react-native-async-storage/async-storage";
 import { theme } from "../theme";
 
+const ESP32_BASE_URL = "http://10.0.0.122";
+// Identifies this phone to the hub; breaks ties between edits made in the same millisecond
+const REPLICA_ID = `phone-${Math.random().toString(36).slice(2, 10)}`;
+// The list, the queue of unsent edits and the sync position, kept across app restarts
+const STORAGE_KEY = "shoppingList.state";
+// The hub takes at most 16 changes per sync (maxSyncChanges in the firmware)
+// and refuses bodies over 4 KB, so a long offline queue goes out in batches
+const MAX_CHANGES_PER_SYNC = 16;
+const MAX_SYNC_BYTES = 3500;
+
+const utf8Length = (text) =>
+  encodeURIComponent(text).replace(/%[0-9A-F]{2}/g, "x").length;
+
+// The oldest queued changes that fit in one sync
+const takeBatch = (queue) => {
+  const batch = [];
+  let bytes = 100; // replica, epoch and since
+  for (const change of queue) {
+    bytes += utf8Length(JSON.stringify(change)) + 1;
+    if (batch.length === MAX_CHANGES_PER_SYNC || bytes > MAX_SYNC_BYTES) {
+      break;
+    }
+    batch.push(change);
+  }
+  return batch;
+};
+
+// Newest first. Ids start with the creation time, so they sort by age.
+const sortItems = (itemsById) =>
+  Object.values(itemsById).sort((a, b) => (a.id < b.id ? 1 : -1));
+
 export default function ShoppingList() {
   const [items, setItems] = useState([]);
   const [inputText, setInputText] = useState("");
   const [loading, setLoading] = useState(true);
+  const [isConnected, setIsConnected] = useState(true);
 
-  // Listen for real-time updates
-  useEffect(() => {
-    const unsubscribe = onSnapshot(
-      collection(db, "shoppingItems"),
-      (snapshot) => {
-        const itemsData = snapshot.docs.map((doc) => ({
-          id: doc.id,
-          ...doc.data(),
-        }));
-        // Sort by creation time
-        itemsData.sort((a, b) => {
-          if (a.createdAt && b.createdAt) {
-            return b.createdAt.toMillis() - a.createdAt.toMillis();
-          }
-          return 0;
-        });
-        setItems(itemsData);
-        setLoading(false);
-      },
-      (error) => {
-        console.error("Error fetching items:", error);
-        Alert.alert("Error", "Failed to load shopping list");
-        setLoading(false);
-      },
-    );
-
-    return () => unsubscribe();
-  }, []);
+  // The hub holds the list. Local edits are applied immediately and queued,
+  // then sent in batches, so the list keeps working offline. The queue and
+  // the last list are saved, so neither is lost if the app is closed first.
+  const itemsById = useRef({});
+  const pendingChanges = useRef([]);
+  const syncState = useRef({ epoch: 0, seq: 0 });
+  const syncing = useRef(false);
 
-  const addItem = async () => {
-    if (inputText.trim()) {
-      try {
-        await addDoc(collection(db, "shoppingItems"), {
-          text: inputText.trim(),
-          completed: false,
-          createdAt: serverTimestamp(),
-          updatedAt: serverTimestamp(),
-        });
-        setInputText("");
-      } catch (error) {
-        console.error("Error adding item:", error);
-        Alert.alert("Error", "Failed to add item");
-      }
+  const applyChange = (change) => {
+    if (change.deleted) {
+      delete itemsById.current[change.id];
+    } else {
+      itemsById.current[change.id] = {
+        ...itemsById.current[change.id],
+        ...change,
+      };
     }
   };
 
-  const toggleItem = async (id, currentCompleted) => {
+  const saveState = () =>
+    AsyncStorage.setItem(
+      STORAGE_KEY,
+      JSON.stringify({
+        items: itemsById.current,
+        pending: pendingChanges.current,
+        sync: syncState.current,
+      }),
+    ).catch((error) => console.error("Shopping list save error:", error));
+
+  const sync = async () => {
+    if (syncing.current) {
+      return;
+    }
+    syncing.current = true;
+    const sent = takeBatch(pendingChanges.current);
+    let more = false;
+
     try {
-      const itemRef = doc(db, "shoppingItems", id);
-      await updateDoc(itemRef, {
-        completed: !currentCompleted,
-        updatedAt: serverTimestamp(),
+      const response = await fetch(`${ESP32_BASE_URL}/api/shopping/sync`, {
+        method: "POST",
+        headers: { "Content-Type": "application/json" },
+        body: JSON.stringify({
+          replica: REPLICA_ID,
+          epoch: syncState.current.epoch,
+          since: syncState.current.seq,
+          changes: sent,
+        }),
       });
+      const data = await response.json();
+
+      if (data.status === "success") {
+        setIsConnected(true);
+        pendingChanges.current = pendingChanges.current.slice(sent.length);
+        syncState.current = { epoch: data.epoch, seq: data.seq };
+
+        if (data.full) {
+          itemsById.current = {};
+        }
+        data.items.forEach(applyChange);
+        // Edits made while this sync was in flight still win locally
+        pendingChanges.current.forEach(applyChange);
+        setItems(sortItems(itemsById.current));
+        saveState();
+        more = pendingChanges.current.length > 0;
+      }
     } catch (error) {
-      console.error("Error updating item:", error);
-      Alert.alert("Error", "Failed to update item");
+      console.error("Shopping list sync error:", error);
+      setIsConnected(false);
+    } finally {
+      syncing.current = false;
+      setLoading(false);
+    }
+    // Send the rest of a long queue without waiting for the next poll
+    if (more) {
+      sync();
     }
   };
 
-  const deleteItem = async (id) => {
-    try {
-      await deleteDoc(doc(db, "shoppingItems", id));
-    } catch (error) {
-      console.error("Error deleting item:", error);
-      Alert.alert("Error", "Failed to delete item");
+  // Restore the saved list, then poll the hub for changes made on other phones
+  useEffect(() => {
+    let interval = null;
+    let cancelled = false;
+
+    const start = async () => {
+      try {
+        const saved = await AsyncStorage.getItem(STORAGE_KEY);
+        if (saved) {
+          const state = JSON.parse(saved);
+          itemsById.current = state.items;
+          pendingChanges.current = state.pending;
+          syncState.current = state.sync;
+          setItems(sortItems(itemsById.current));
+          setLoading(false);
+        }
+      } catch (error) {
+        console.error("Shopping list load error:", error);
+      }
+      if (!cancelled) {
+        interval = setInterval(sync, 2000);
+        sync();
+      }
+    };
+    start();
+
+    return () => {
+      cancelled = true;
+      clearInterval(interval);
+    };
+  }, []);
+
+  const queueChange = (change) => {
+    const stamped = { ...change, ts: Date.now() };
+    pendingChanges.current.push(stamped);
+    applyChange(stamped);
+    setItems(sortItems(itemsById.current));
+    saveState();
+    sync();
+  };
+
+  const addItem = () => {
+    if (inputText.trim()) {
+      const id =
+        Date.now().toString(36) + Math.random().toString(36).slice(2, 8);
+      queueChange({
+        id,
+        text: inputText.trim().slice(0, 63),
+        completed: false,
+        deleted: false,
+      });
+      setInputText("");
     }
   };
 
+  const toggleItem = (id, currentCompleted) => {
+    queueChange({ id, completed: !currentCompleted });
+  };
+
+  const deleteItem = (id) => {
+    queueChange({ id, deleted: true });
+  };
+
   const renderItem = ({ item }) => (
     <View style={styles.itemContainer}>
       <TouchableOpacity
@@ -134,6 +229,11 @@ export default function ShoppingList() {
           <Text style={styles.addButtonText}>Add</Text>
         </TouchableOpacity>
       </View>
+      {!isConnected && (
+        <Text style={styles.offlineText}>
+          Offline - changes will sync when the hub is reachable
+        </Text>
+      )}
       {items.length === 0 && (
         <View style={styles.emptyContainer}>
           <Text style={styles.emptyText}>No items yet. Add something!</Text>
@@ -229,6 +329,12 @@ const styles = StyleSheet.create({
     justifyContent: "center",
     alignItems: "center",
   },
+  offlineText: {
+    fontSize: 14,
+    color: theme.colorGrey,
+    textAlign: "center",
+    marginBottom: 10,
+  },
   emptyText: {
     fontSize: 16,
     color: theme.colorLightGrey,
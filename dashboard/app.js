@@ -0,0 +1,57 @@
+// Served by the hub itself, so every request is same-origin: no CORS
+// preflight, and relative URLs work whatever the hub's address is.
+
+const formatTime = (seconds) =>
+  `${String(Math.floor(seconds / 60)).padStart(2, "0")}:${String(seconds % 60).padStart(2, "0")}`;
+
+const render = (lights, timer, dishwasher, household) => {
+  const clean = lights["green light"] === "on";
+  const dirty = lights["red light"] === "on";
+  const dishes = document.getElementById("dishes");
+  dishes.textContent = clean ? "Clean" : dirty ? "Dirty" : "Unknown";
+  dishes.className = `status ${clean ? "clean" : dirty ? "dirty" : ""}`;
+
+  document.getElementById("cycle").textContent =
+    dishwasher.cycle === "running"
+      ? `Cycle running for ${Math.floor(dishwasher.cycleSeconds / 60)} min`
+      : dishwasher.lastCycleSeconds
+        ? `Last cycle took ${Math.floor(dishwasher.lastCycleSeconds / 60)} min`
+        : "";
+
+  document.getElementById("timer").textContent = formatTime(timer.remaining);
+  document.getElementById("timerState").textContent = timer.timer;
+
+  const hubs = document.getElementById("hubs");
+  hubs.replaceChildren(
+    ...household.hubs.map((hub) => {
+      const item = document.createElement("li");
+      const hubClean = hub.lights["green light"] === "on";
+      item.textContent = `${hub.name}: ${hubClean ? "clean" : "dirty"}, timer ${hub.timer}${hub.online ? "" : " (offline)"}`;
+      return item;
+    }),
+  );
+};
+
+const refresh = async () => {
+  try {
+    const [lights, timer, dishwasher, household] = await Promise.all(
+      ["/api/lights", "/api/timer", "/api/dishwasher", "/api/household"].map(
+        (path) => fetch(path).then((response) => response.json()),
+      ),
+    );
+    render(lights.lights, timer, dishwasher, household);
+    document.getElementById("offline").hidden = true;
+  } catch (error) {
+    document.getElementById("offline").hidden = false;
+  }
+};
+
+document.querySelectorAll("button[data-post]").forEach((button) => {
+  button.addEventListener("click", async () => {
+    await fetch(button.dataset.post, { method: "POST" }).catch(() => {});
+    refresh();
+  });
+});
+
+setInterval(refresh, 1000);
+refresh();
@@ -0,0 +1,109 @@
+#include "display_render.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// 5x7 glyphs, one byte per column, bit 0 at the top
+const uint8_t fontDigits[][5] = {
+  {0x3E, 0x51, 0x49, 0x45, 0x3E}, {0x00, 0x42, 0x7F, 0x40, 0x00},
+  {0x72, 0x49, 0x49, 0x49, 0x46}, {0x21, 0x41, 0x49, 0x4D, 0x33},
+  {0x18, 0x14, 0x12, 0x7F, 0x10}, {0x27, 0x45, 0x45, 0x45, 0x39},
+  {0x3C, 0x4A, 0x49, 0x49, 0x31}, {0x41, 0x21, 0x11, 0x09, 0x07},
+  {0x36, 0x49, 0x49, 0x49, 0x36}, {0x46, 0x49, 0x49, 0x29, 0x1E}
+};
+const uint8_t fontLetters[][5] = {
+  {0x7C, 0x12, 0x11, 0x12, 0x7C}, {0x7F, 0x49, 0x49, 0x49, 0x36},
+  {0x3E, 0x41, 0x41, 0x41, 0x22}, {0x7F, 0x41, 0x41, 0x41, 0x3E},
+  {0x7F, 0x49, 0x49, 0x49, 0x41}, {0x7F, 0x09, 0x09, 0x09, 0x01},
+  {0x3E, 0x41, 0x41, 0x51, 0x73}, {0x7F, 0x08, 0x08, 0x08, 0x7F},
+  {0x00, 0x41, 0x7F, 0x41, 0x00}, {0x20, 0x40, 0x41, 0x3F, 0x01},
+  {0x7F, 0x08, 0x14, 0x22, 0x41}, {0x7F, 0x40, 0x40, 0x40, 0x40},
+  {0x7F, 0x02, 0x1C, 0x02, 0x7F}, {0x7F, 0x04, 0x08, 0x10, 0x7F},
+  {0x3E, 0x41, 0x41, 0x41, 0x3E}, {0x7F, 0x09, 0x09, 0x09, 0x06},
+  {0x3E, 0x41, 0x51, 0x21, 0x5E}, {0x7F, 0x09, 0x19, 0x29, 0x46},
+  {0x26, 0x49, 0x49, 0x49, 0x32}, {0x03, 0x01, 0x7F, 0x01, 0x03},
+  {0x3F, 0x40, 0x40, 0x40, 0x3F}, {0x1F, 0x20, 0x40, 0x20, 0x1F},
+  {0x3F, 0x40, 0x38, 0x40, 0x3F}, {0x63, 0x14, 0x08, 0x14, 0x63},
+  {0x03, 0x04, 0x78, 0x04, 0x03}, {0x61, 0x59, 0x49, 0x4D, 0x43}
+};
+const uint8_t fontColon[5] = {0x00, 0x00, 0x14, 0x00, 0x00};
+const uint8_t fontBlank[5] = {0x00, 0x00, 0x00, 0x00, 0x00};
+
+static const uint8_t* glyphFor(char c) {
+  if (c >= '0' && c <= '9') {
+    return fontDigits[c - '0'];
+  }
+  if (c >= 'a' && c <= 'z') {
+    c -= 'a' - 'A';
+  }
+  if (c >= 'A' && c <= 'Z') {
+    return fontLetters[c - 'A'];
+  }
+  return c == ':' ? fontColon : fontBlank;
+}
+
+void setDisplayPixel(uint8_t* frame, int x, int y, bool on) {
+  if (x < 0 || x >= displayWidth || y < 0 || y >= displayHeight) {
+    return;
+  }
+  uint8_t bit = 1 << (y & 7);
+  if (on) {
+    frame[(y >> 3) * displayWidth + x] |= bit;
+  } else {
+    frame[(y >> 3) * displayWidth + x] &= ~bit;
+  }
+}
+
+bool getDisplayPixel(const uint8_t* frame, int x, int y) {
+  return frame[(y >> 3) * displayWidth + x] & (1 << (y & 7));
+}
+
+int drawText(uint8_t* frame, int x, int y, const char* text, int scale) {
+  for (; *text; text++) {
+    const uint8_t* glyph = glyphFor(*text);
+    for (int column = 0; column < 5; column++) {
+      for (int row = 0; row < 7; row++) {
+        bool on = glyph[column] & (1 << row);
+        for (int dx = 0; dx < scale; dx++) {
+          for (int dy = 0; dy < scale; dy++) {
+            setDisplayPixel(frame, x + column * scale + dx, y + row * scale + dy, on);
+          }
+        }
+      }
+    }
+    x += 6 * scale;
+  }
+  return x;
+}
+
+void renderTimerScreen(uint8_t* frame, uint32_t remainingSeconds, const char* state, uint32_t presetSeconds) {
+  memset(frame, 0, framebufferBytes);
+
+  drawText(frame, 0, 0, state, 1);
+
+  char text[24];
+  uint32_t minutes = remainingSeconds / 60;
+  snprintf(text, sizeof(text), "%02lu:%02lu", (unsigned long)(minutes > 99 ? 99 : minutes),
+           (unsigned long)(remainingSeconds % 60));
+  // Five characters at scale 3 are 90 px wide; centre them
+  drawText(frame, (displayWidth - 90) / 2, 20, text, 3);
+
+  snprintf(text, sizeof(text), "PRESET %lu", (unsigned long)(presetSeconds / 60));
+  int x = drawText(frame, 0, 56, text, 1);
+  drawText(frame, x, 56, " MIN", 1);
+}
+
+void writePbm(const uint8_t* frame, PbmWriter write, void* context) {
+  char header[16];
+  int length = snprintf(header, sizeof(header), "P1\n%d %d\n", displayWidth, displayHeight);
+  write(context, header, length);
+  // One write per row; a write per pixel is far too slow over a socket
+  char row[displayWidth + 1];
+  for (int y = 0; y < displayHeight; y++) {
+    for (int x = 0; x < displayWidth; x++) {
+      row[x] = getDisplayPixel(frame, x, y) ? '1' : '0';
+    }
+    row[displayWidth] = '\n';
+    write(context, row, sizeof(row));
+  }
+}
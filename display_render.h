@@ -0,0 +1,27 @@
+// Timer screen rendering for the 128x64 SSD1306. Draws into a framebuffer in
+// the panel's layout (one byte per column per 8-row page, bit 0 at the top)
+// and has no Arduino dependencies, so screens can be rendered and compared
+// on a host (see test/test_display_render.cpp).
+#ifndef DISPLAY_RENDER_H
+#define DISPLAY_RENDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+const int displayWidth = 128;
+const int displayPages = 8;
+const int displayHeight = displayPages * 8;
+const size_t framebufferBytes = displayPages * displayWidth;
+
+void setDisplayPixel(uint8_t* frame, int x, int y, bool on);
+bool getDisplayPixel(const uint8_t* frame, int x, int y);
+// Draws text with its top-left corner at (x, y), each font pixel scaled to
+// a scale x scale block. Returns the x position after the last character.
+int drawText(uint8_t* frame, int x, int y, const char* text, int scale);
+void renderTimerScreen(uint8_t* frame, uint32_t remainingSeconds, const char* state, uint32_t presetSeconds);
+
+// Writes the framebuffer as a plain-text PBM image, a row per call of write
+typedef void (*PbmWriter)(void* context, const char* data, size_t length);
+void writePbm(const uint8_t* frame, PbmWriter write, void* context);
+
+#endif
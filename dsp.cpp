@@ -0,0 +1,118 @@
+#include "dsp.h"
+
+#include <math.h>
+#include <string.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+void removeDcOffset(int16_t* samples, int count, int32_t& level) {
+  if (level == 0 && count > 0) {
+    // Start from the first sample instead of ramping up from zero
+    level = (int32_t)samples[0] << 8;
+  }
+  for (int i = 0; i < count; i++) {
+    level += (((int32_t)samples[i] << 8) - level) >> 10;
+    samples[i] = samples[i] - (int16_t)(level >> 8);
+  }
+}
+
+uint32_t integerSqrt(uint64_t value) {
+  uint64_t result = 0;
+  uint64_t bit = (uint64_t)1 << 62;
+  while (bit > value) {
+    bit >>= 2;
+  }
+  while (bit != 0) {
+    if (value >= result + bit) {
+      value -= result + bit;
+      result = (result >> 1) + bit;
+    } else {
+      result >>= 1;
+    }
+    bit >>= 2;
+  }
+  return (uint32_t)result;
+}
+
+uint16_t windowRms(const int16_t* samples, int count) {
+  uint64_t sumSquares = 0;
+  for (int i = 0; i < count; i++) {
+    sumSquares += (int32_t)samples[i] * samples[i];
+  }
+  return integerSqrt(sumSquares / count);
+}
+
+int32_t goertzelCoefficient(uint32_t frequency, uint32_t sampleRate, int count) {
+  // Round to the nearest bin so the filter has no leakage for a stable tone
+  int bin = (int)((float)count * frequency / sampleRate + 0.5f);
+  return (int32_t)(2.0f * cosf(2.0f * (float)M_PI * bin / count) * 16384.0f);
+}
+
+uint16_t bandAmplitude(const int16_t* samples, int count, int32_t coeff) {
+  int32_t s1 = 0;
+  int32_t s2 = 0;
+  for (int i = 0; i < count; i++) {
+    int32_t s0 = samples[i] + (int32_t)(((int64_t)coeff * s1) >> 14) - s2;
+    s2 = s1;
+    s1 = s0;
+  }
+  int64_t power = (int64_t)s1 * s1 + (int64_t)s2 * s2 - ((((int64_t)coeff * s1) >> 14) * s2);
+  if (power < 0) {
+    power = 0;
+  }
+  return (uint16_t)((2 * integerSqrt((uint64_t)power)) / count);
+}
+
+void resetDishwasherDetector(DishwasherDetector& detector) {
+  memset(&detector, 0, sizeof(detector));
+  detector.goertzelCoeff = goertzelCoefficient(bandFrequency, dspSampleRate, dspWindowSize);
+}
+
+CycleEvent processDishwasherWindow(DishwasherDetector& detector, int16_t* samples, int count) {
+  removeDcOffset(samples, count, detector.dcLevel);
+  detector.lastRms = windowRms(samples, count);
+  detector.lastBandAmplitude = bandAmplitude(samples, count, detector.goertzelCoeff);
+  uint16_t level = detector.lastRms > detector.lastBandAmplitude ? detector.lastRms : detector.lastBandAmplitude;
+  return updateCycleDetector(detector, level);
+}
+
+CycleEvent updateCycleDetector(DishwasherDetector& detector, uint16_t level) {
+  if (!detector.running) {
+    detector.activeWindows = level > cycleStartLevel ? detector.activeWindows + 1 : 0;
+    if (detector.activeWindows >= cycleStartWindows) {
+      detector.running = true;
+      detector.cycleWindows = detector.activeWindows;
+      detector.quietWindows = 0;
+      return cycleStarted;
+    }
+    return cycleNone;
+  }
+
+  detector.cycleWindows++;
+  detector.quietWindows = level < cycleStopLevel ? detector.quietWindows + 1 : 0;
+  if (detector.quietWindows < cycleStopWindows) {
+    return cycleNone;
+  }
+
+  // Quiet long enough: the cycle is over. Short bursts (someone bumping the
+  // machine) never reach minCycleWindows and are dropped.
+  uint32_t runWindows = detector.cycleWindows - detector.quietWindows;
+  detector.running = false;
+  detector.activeWindows = 0;
+  detector.quietWindows = 0;
+  if (runWindows < minCycleWindows) {
+    return cycleIgnored;
+  }
+  detector.lastCycleSeconds = (uint64_t)runWindows * dspWindowSize / dspSampleRate;
+  detector.cyclesCompleted++;
+  return cycleFinished;
+}
+
+uint32_t runningCycleSeconds(const DishwasherDetector& detector) {
+  if (!detector.running) {
+    return 0;
+  }
+  return (uint64_t)detector.cycleWindows * dspWindowSize / dspSampleRate;
+}
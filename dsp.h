@@ -0,0 +1,64 @@
+// Dishwasher sensor signal processing: fixed-point feature extraction and the
+// cycle detector. No Arduino or IDF dependencies, so recorded traces can be
+// replayed through it on a host (see test/test_dsp.cpp).
+#ifndef DSP_H
+#define DSP_H
+
+#include <stdint.h>
+
+// Features are computed over windows of dspWindowSize samples (128 ms at the
+// 2 kHz decimated rate). bandFrequency is the vibration/current component
+// tracked by the Goertzel filter: mains frequency for a current clamp, pump
+// speed for a vibration sensor.
+const uint32_t dspSampleRate = 2000;
+const int dspWindowSize = 256;
+const uint32_t bandFrequency = 60;
+
+// Cycle detection hysteresis, in ADC counts and windows. A cycle starts after
+// ~2 s above the start level and ends after ~10 min below the stop level,
+// which rides through the quiet soak and drying phases.
+const uint16_t cycleStartLevel = 60;
+const uint16_t cycleStopLevel = 30;
+const uint32_t cycleStartWindows = 16;
+const uint32_t cycleStopWindows = 4688;
+const uint32_t minCycleWindows = 4688;
+
+enum CycleEvent {
+  cycleNone,
+  cycleStarted,
+  cycleFinished,  // lastCycleSeconds holds its length
+  cycleIgnored,   // Activity ended before minCycleWindows
+};
+
+struct DishwasherDetector {
+  int32_t dcLevel;        // Q8 running mean of the raw signal
+  int32_t goertzelCoeff;  // Q14, 2*cos(2*pi*k/N)
+  uint16_t lastRms;
+  uint16_t lastBandAmplitude;
+  bool running;
+  uint32_t activeWindows;
+  uint32_t quietWindows;
+  uint32_t cycleWindows;
+  uint32_t lastCycleSeconds;
+  uint32_t cyclesCompleted;
+};
+
+// The kernels only touch the buffers and counters passed to them and never
+// allocate
+
+// Removes the DC offset in place using a Q8 running mean
+void removeDcOffset(int16_t* samples, int count, int32_t& level);
+uint32_t integerSqrt(uint64_t value);
+uint16_t windowRms(const int16_t* samples, int count);
+int32_t goertzelCoefficient(uint32_t frequency, uint32_t sampleRate, int count);
+// Amplitude (ADC counts) of the window's component at the Goertzel bin
+uint16_t bandAmplitude(const int16_t* samples, int count, int32_t coeff);
+
+void resetDishwasherDetector(DishwasherDetector& detector);
+// Runs one window (modified in place) through the features and the detector
+CycleEvent processDishwasherWindow(DishwasherDetector& detector, int16_t* samples, int count);
+CycleEvent updateCycleDetector(DishwasherDetector& detector, uint16_t level);
+// Length of the cycle in progress, 0 when idle
+uint32_t runningCycleSeconds(const DishwasherDetector& detector);
+
+#endif
@@ -2,29 +2,67 @@
 // Wire green LED to GPIO 18 for "clean"
 // Wire red LED to GPIO 19 for "dirty"
 // Wire button to GPIO 21 to toggle LEDs
+// Wire vibration/current sensor output to GPIO 34 for dishwasher cycle detection
+// Wire rotary encoder A/B to GPIO 25/26 to select timer presets
+// Wire SSD1306 OLED SDA/SCL to GPIO 32/33 for the timer display
+// Wire I2S amplifier (e.g. MAX98357A) BCLK/LRC/DIN to GPIO 27/14/13 for the alarm
 
 #include <WiFi.h>
 #include <ArduinoJson.h>
 #include<ESPmDNS.h>
+#include <esp_timer.h>
+#include <esp_adc/adc_continuous.h>
+#include <Wire.h>
+#include <driver/i2s_std.h>
+#include <esp_partition.h>
+#include <esp_random.h>
+#include <LittleFS.h>
+#include <HTTPClient.h>
+#include <WiFiUdp.h>
+#include <Preferences.h>
+#include <esp_ota_ops.h>
+#include <esp_system.h>
+#include <mbedtls/sha256.h>
+#include <esp_heap_caps.h>
+#include <time.h>
+#include "dsp.h"
+#include "display_render.h"
+#include "shopping_store.h"
+#include "replication.h"
+#include "ota_update.h"
+#include "history.h"
+#include "http_request.h"
+#include "api_json.h"
 
-// Server code to be uploaded and ran on ESP-32
-// Wire green LED to GPIO 18 for "clean"
-// Wire red LED to GPIO 19 for "dirty"
-// Wire button to GPIO 21 to toggle LEDs
-
-#include <WiFi.h>
-#include <ArduinoJson.h>
-#include<ESPmDNS.h>
+// REPLACE WITH YOUR NETWORK CREDENTIALS BEFORE UPLOADING
+const char* ssid = "YOUR_WIFI_NETWORK";
+const char* password = "YOUR_WIFI_PASSWORD";
 
-// REPLACE WITH NETWORK CREDENTIALS
-const char* ssid = "4-matic";
-const char* password = "Colorado24";
 
 // Set web server port number to 80
 WiFiServer server(80);
 
-// Variable to store the HTTP request
-String header;
+// The request being read and the response being built (see http_request.h)
+HttpRequest httpRequest;
+HttpResponse httpResponse;
+
+// WiFiClient behind the interface in http_request.h
+class WiFiClientConnection : public HttpConnection {
+ public:
+  explicit WiFiClientConnection(WiFiClient& client) : client(client) {}
+  int available() override {
+    return client.available();
+  }
+  int read(uint8_t* data, size_t length) override {
+    return client.read(data, length);
+  }
+  size_t write(const uint8_t* data, size_t length) override {
+    return client.write(data, length);
+  }
+
+ private:
+  WiFiClient& client;
+};
 
 // Auxiliar variables to store the current output state
 String redLightState = "off";
@@ -36,34 +74,304 @@ const int greenLight = 19;
 const int lightButton = 21;
 const int timerButton = 22;
 
-// Light button state variables
+// Light button state variables (times in microseconds)
 bool lastLightButtonState = HIGH;
 bool currentLightButtonState = HIGH;
-unsigned long lastDebounceTime = 0;
-unsigned long debounceDelay = 50;
+uint64_t lastDebounceTime = 0;
+uint64_t debounceDelay = 50000;
 
-// Timer button state variables
+// Timer button state variables (times in microseconds)
 bool lastTimerButtonState = HIGH;
 bool currentTimerButtonState = HIGH;
-unsigned long lastTimerDebounceTime = 0;
-unsigned long timerDebounceDelay = 50;
+uint64_t lastTimerDebounceTime = 0;
+uint64_t timerDebounceDelay = 50000;
 
 // Timer state variable
 String timerState = "stopped"; // "stopped", "running", "paused"
 
-// Current time
-unsigned long currentTime = millis();
-// Previous time
-unsigned long previousTime = 0;
-// Define timeout time in milliseconds
-const long timeoutTime = 2000;
-
-IPAddress local_IP(10, 0, 0, 122);
-IPAddress gateway(10, 0, 0, 1);
+// Timer countdown, in microseconds on the scheduler clock
+const uint32_t timerPresets[] = {60, 180, 300, 600, 900, 1200, 1800, 2700, 3600}; // seconds
+const int timerPresetCount = sizeof(timerPresets) / sizeof(timerPresets[0]);
+int timerPresetIndex = 2; // 5 minutes, same as the app
+uint64_t timerDuration = 300000000;
+uint64_t timerElapsed = 0;   // Run time banked before the last pause
+uint64_t timerResumedAt = 0;
+
+// Rotary encoder, decoded in the pin-change interrupt. Counts move by 4 per detent.
+const int encoderPinA = 25;
+const int encoderPinB = 26;
+volatile int32_t encoderCount = 0;
+volatile uint8_t encoderLastState = 0;
+int32_t encoderConsumed = 0;
+
+// SSD1306 128x64 OLED. Rendering (display_render.h) goes to displayBuffer;
+// displayShadow holds what the panel is showing, so only the changed columns
+// of each page are sent.
+const int oledSda = 32;
+const int oledScl = 33;
+const uint8_t oledAddress = 0x3C;
+uint8_t displayBuffer[framebufferBytes];
+uint8_t displayShadow[framebufferBytes];
+bool displayReady = false;
+uint32_t displayedSeconds = UINT32_MAX; // Forces the first render
+String displayedTimerState = "";
+int displayedPresetIndex = -1;
+uint32_t displayBytesSent = 0;
+
+// Alarm clip: a 16-bit mono PCM WAV flashed into the "alarm" partition
+// (see partitions.csv), e.g.
+//   ffmpeg -i assets/iphone_alarm.mp3 -ac 1 -ar 16000 -sample_fmt s16 alarm.wav
+//   esptool.py write_flash 0x290000 alarm.wav
+// It is streamed from flash in chunks; the whole clip is never copied to RAM.
+const gpio_num_t i2sBclk = GPIO_NUM_27;
+const gpio_num_t i2sWs = GPIO_NUM_14;
+const gpio_num_t i2sDout = GPIO_NUM_13;
+const esp_partition_t* alarmPartition = NULL;
+i2s_chan_handle_t i2sTx = NULL;
+uint32_t alarmDataOffset = 0;
+uint32_t alarmDataSize = 0;
+uint32_t alarmSampleRate = 16000;
+const int alarmRepeats = 3;
+
+// Double buffering: one chunk drains into the I2S DMA ring while the next is
+// read from flash
+const int audioChunkBytes = 1024;
+// 4 x 256 frames is 64 ms of audio at 16 kHz, far more than the task period
+const int audioDmaBuffers = 4;
+const int audioDmaFrames = 256;
+uint8_t audioBuffers[2][audioChunkBytes];
+int audioFront = 0;              // Buffer being written to I2S
+uint32_t audioFrontLength = 0;
+uint32_t audioFrontSent = 0;
+bool audioBackReady = false;
+uint32_t audioBackLength = 0;
+uint32_t alarmReadOffset = 0;    // Next clip byte to read from flash
+int alarmPlaysLeft = 0;
+bool alarmPlaying = false;
+// Once the last chunk is queued the channel stays enabled until the DMA ring
+// has played it out
+volatile bool alarmDraining = false;
+uint64_t alarmDrainUntil = 0;
+
+// Playback measurements
+volatile uint32_t audioUnderruns = 0;
+uint32_t audioChunksRead = 0;
+uint64_t audioBusyTime = 0;      // Time spent in the audio task while playing
+uint64_t audioPlayTime = 0;      // Wall time spent playing
+uint64_t alarmStartedAt = 0;
+
+// Shopping list. The hub holds the authoritative copy (see shopping_store.h),
+// logged to LittleFS so it survives a restart. The log has its own
+// "shopping" partition, so uploading a dashboard image (which replaces the
+// whole "spiffs" partition) leaves the list alone.
+ShoppingStore shopping;
+fs::LittleFSFS shoppingFs;
+const char* shoppingLogPath = "/shopping.log";
+const char* shoppingTempPath = "/shopping.tmp";
+bool shoppingStoreReady = false;
+// A sync carries at most this many changes; the app sends its queue in
+// batches of this size so a sync body always fits in maxBodyLength
+const int maxSyncChanges = 16;
+
+// Batched push to a Firestore-like upstream; empty disables it. The upstream
+// receives {"hub", "changes": [...]} and may answer with its own changes.
+// The HTTP round trip runs in its own FreeRTOS task, since it can take
+// seconds; the scheduler task hands it a serialized batch and merges the
+// reply once the worker posts the status code to upstreamDone. Each side
+// touches the two buffers only while it owns the round trip.
+const char* shoppingUpstreamUrl = "";
+const int upstreamBatchSize = 16;
+const uint64_t upstreamInterval = 30000000;
+const size_t upstreamRequestBytes = 4096;
+const size_t upstreamReplyBytes = 8192;
+char upstreamRequest[upstreamRequestBytes];
+char upstreamReply[upstreamReplyBytes];
+TaskHandle_t upstreamWorker = NULL;
+QueueHandle_t upstreamDone = NULL;
+bool upstreamInFlight = false;
+uint32_t upstreamPendingThrough = 0;
+uint64_t nextUpstreamSync = 0;
+uint32_t upstreamBatches = 0;
+uint32_t upstreamFailures = 0;
+
+// Client currently being served. The network task reads it in slices, so the
+// connection state has to outlive a single call.
+WiFiClient activeClient;
+bool clientActive = false;
+uint64_t clientStartTime = 0;
+// Define timeout time in microseconds
+const uint64_t timeoutTime = 2000000;
+
+// Scheduler: run-to-completion tasks kept in a min-heap ordered by deadline.
+// All times come from the 64-bit esp_timer clock, which does not wrap
+// (millis() rolls over after ~49 days).
+typedef void (*TaskFunction)(uint64_t sliceEnd);
+
+struct ScheduledTask {
+  const char* name;
+  TaskFunction run;
+  uint64_t period;          // Time between deadlines
+  uint64_t budget;          // Time one run may take; passed to the task as sliceEnd
+  uint8_t priority;         // Lower runs first when deadlines tie
+  uint64_t deadline;        // Next time the task is due
+  uint32_t runs;
+  uint32_t overruns;        // Runs that took longer than budget
+  uint32_t missedDeadlines; // Runs that started a full period late
+  uint64_t maxRunTime;
+  uint64_t maxLateness;
+};
+
+const int maxTasks = 16;
+ScheduledTask tasks[maxTasks];
+int taskHeap[maxTasks];
+int taskCount = 0;
+
+// Network work yields once it has spent this long in one slice
+const uint64_t networkBudget = 3000;
+
+// Time spent with nothing due, for the stats endpoint
+uint64_t idleTime = 0;
+// Longest run of any task since last cleared; an OTA upload clears it at
+// the start and reports it at the end
+uint64_t schedulerMaxRun = 0;
+uint64_t schedulerStartTime = 0;
+
+// Dishwasher sensor sampling. The ADC runs in continuous (DMA) mode at its
+// 20 kHz minimum on GPIO 34 (ADC1 channel 6); every block of
+// adcDecimation readings is averaged into one 2 kHz sample.
+adc_continuous_handle_t adcHandle = NULL;
+const int adcDecimation = 10;
+const uint32_t adcSampleRate = dspSampleRate * adcDecimation;
+const int adcFrameBytes = 256;
+uint8_t adcFrame[adcFrameBytes];
+int32_t decimationSum = 0;
+int decimationCount = 0;
+volatile uint32_t adcPoolOverflows = 0;
+
+// Decimated samples waiting for feature extraction (power of two for masking)
+const uint32_t sampleRingSize = 1024;
+int16_t sampleRing[sampleRingSize];
+uint32_t sampleRingHead = 0;
+uint32_t sampleRingTail = 0;
+uint32_t droppedSamples = 0;
+
+// Feature extraction and cycle detection state (dsp.h)
+int16_t dspWindow[dspWindowSize];
+DishwasherDetector dishwasher;
+
+// Network configuration - adjust for your network. Every hub needs its own
+// address; set useStaticIP to false on extra hubs to use DHCP and find them
+// through mDNS (<hubName>.local) or GET /api/household.
+const bool useStaticIP = true;
+IPAddress local_IP(192, 168, 1, 100);      // Change to your desired IP
+IPAddress gateway(192, 168, 1, 1);         // Change to your router IP
 IPAddress subnet(255, 255, 255, 0);
 
+// Name shown for this hub in the household view, also its mDNS host name
+const char* hubName = "kitchen";
+
+// Household replication (see replication.h) over UDP broadcast
+const uint16_t replicationPort = 4210;
+WiFiUDP replicationUdp;
+Replication replication;
+uint8_t replicationPacket[maxReplicationPacket]; // Incoming
+bool replicationReady = false;
+uint32_t versionsAdoptedSaved = 0;
+
+// Firmware update (see ota_update.h). The upload gets its own connection
+// slot and task so the network task keeps serving other requests in the
+// meantime. Uploads must send otaToken in the X-OTA-Token header; an empty
+// token disables them.
+const char* otaToken = "";
+const uint64_t bootCheckTimeout = 60000000;
+WiFiClient otaClient;
+OtaUpload otaUpload;
+uint64_t otaMaxStall = 0;   // Longest scheduler task run during the last upload
+uint64_t otaRestartAt = 0;
+bool otaPendingVerify = false; // Running a new image that has not passed the boot check
+
+// Web dashboard, built into data/ by scripts/build-dashboard.js and uploaded
+// to LittleFS. Files are already gzipped and manifest.txt lists, per asset:
+// URL path, file, strong ETag, content type and cache lifetime in seconds.
+// Files are streamed in staticChunkBytes pieces, never loaded whole, over
+// as many network slices as it takes.
+struct StaticAsset {
+  char path[40];
+  char file[44];
+  char etag[20];
+  char type[28];
+  uint32_t maxAge;
+};
+
+const int maxStaticAssets = 16;
+const int staticChunkBytes = 1460; // One TCP segment
+StaticAsset staticAssets[maxStaticAssets];
+int staticAssetCount = 0;
+uint8_t staticChunk[staticChunkBytes];
+File staticFile; // Open while the rest of a file is still to be sent
+uint32_t staticResponses = 0;
+uint32_t staticNotModified = 0;
+
+// Usage history (see history.h) on the "history" partition. Records need
+// wall-clock time, so nothing is stored until NTP has set the clock.
+const uint32_t minValidTime = 1600000000; // Anything earlier means NTP has not synced
+History usageHistory;
+uint32_t historyDroppedNoClock = 0;
+
+// Responses are assembled in httpResponse and sent a TCP segment at a time.
+// Timer, lights, shopping, history and stats bodies are written into it by
+// the api_json and history builders; the JSON documents still used for other
+// routes and for parsing are allocated once at boot and cleared for each
+// request, so handlers do not use the heap with two
+// exceptions: a dashboard file allocates a LittleFS handle per request, and
+// a shopping change allocates when it triggers a log compaction (appends go
+// through a handle kept open). Accepting and closing connections allocates
+// inside WiFiClient and lwIP; that is counted apart as connectionAllocations.
+const char* corsHeaders =
+  "Access-Control-Allow-Origin: *\r\n"
+  "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n"
+  "Access-Control-Allow-Headers: Content-Type\r\n";
+
+// Heap accounting. With CONFIG_HEAP_USE_HOOKS enabled in sdkconfig, IDF calls
+// the hooks on every malloc and free; those made by the loop task (which runs
+// all scheduler tasks) are counted, and the network task attributes them to
+// the route being served. Without the option only the gauges are reported.
+RouteStats routeStats[] = {
+  {"GET /api/timer"}, {"POST /api/timer/"}, {"GET /api/lights"}, {"POST /api/lights/"},
+  {"GET /api/dishwasher"}, {"GET /api/display"}, {"POST /api/alarm/"}, {"GET /api/household"},
+  {"GET /api/history"}, {"GET /api/shopping"}, {"POST /api/shopping/"}, {"GET /api/stats"},
+  {"OPTIONS "}, {"GET /api/"}, {"GET /"}, {""},
+};
+const int routeCount = sizeof(routeStats) / sizeof(routeStats[0]);
+
+TaskHandle_t accountedTask = NULL;
+volatile uint32_t heapAllocations = 0;
+volatile uint32_t heapAllocatedBytes = 0;
+volatile uint32_t heapFrees = 0;
+uint32_t connectionAllocations = 0; // In server.available() and WiFiClient::stop()
+
+// Fragmentation gauge, sampled by the heapGauge task
+uint32_t heapFreeBytes = 0;
+uint32_t heapLargestBlock = 0;
+uint32_t minHeapLargestBlock = UINT32_MAX;
+uint8_t heapFragmentation = 0;    // Percent of free memory outside the largest block
+uint8_t maxHeapFragmentation = 0;
+
+// The upstream's replies carry up to a full list of items
+const size_t shoppingResponseCapacity =
+  JSON_OBJECT_SIZE(5) + JSON_ARRAY_SIZE(maxShoppingItems) + maxShoppingItems * JSON_OBJECT_SIZE(6) + 64;
+const size_t householdResponseCapacity = JSON_OBJECT_SIZE(4) + JSON_ARRAY_SIZE(maxHubs) +
+  maxHubs * (JSON_OBJECT_SIZE(11) + JSON_OBJECT_SIZE(2) + 48) + JSON_OBJECT_SIZE(8);
+const size_t responseDocCapacity = max(shoppingResponseCapacity, householdResponseCapacity);
+// Request bodies are parsed in place, so only the nodes need room: a sync's
+// top level and its changes, plus the id and flag a single change may gain
+const size_t requestDocCapacity = JSON_OBJECT_SIZE(4) + JSON_ARRAY_SIZE(maxSyncChanges) +
+  maxSyncChanges * JSON_OBJECT_SIZE(6) + JSON_OBJECT_SIZE(2) + sizeof(ShoppingItem::id);
+DynamicJsonDocument requestDoc(requestDocCapacity);
+DynamicJsonDocument responseDoc(responseDocCapacity);
+
 void setup() {
- if (!WiFi.config(local_IP, gateway, subnet)) {
+ if (useStaticIP && !WiFi.config(local_IP, gateway, subnet)) {
   Serial.println("Static IP configuration failed");
 }
 
@@ -87,9 +395,15 @@ void setup() {
   Serial.print("Connecting to ");
   Serial.println(ssid);
   WiFi.begin(ssid, password);
+  checkPendingFirmware();
   while (WiFi.status() != WL_CONNECTED) {
     delay(500);
     Serial.print(".");
+    // A freshly updated image that cannot reach the network fails its boot check
+    if (otaPendingVerify && monotonicMicros() > bootCheckTimeout) {
+      Serial.println("\nNew firmware failed to connect, rolling back");
+      esp_ota_mark_app_invalid_rollback_and_reboot();
+    }
   }
 
   // Print local IP address and start web server
@@ -97,77 +411,314 @@ void setup() {
   Serial.println("WiFi connected.");
   Serial.println("IP address: ");
   Serial.println(WiFi.localIP());
+  Serial.println("\nDashboard: http://" + WiFi.localIP().toString() + "/");
   Serial.println("\nAPI Endpoints:");
   Serial.println("GET  /api/lights - Get all light states");
   Serial.println("POST /api/lights/red/on - Turn red light ON");
   Serial.println("POST /api/lights/red/off - Turn red light OFF");
   Serial.println("POST /api/lights/green/on - Turn green light ON");
   Serial.println("POST /api/lights/green/off - Turn green light OFF");
+  Serial.println("GET  /api/household - Get state of every hub in the household");
+  Serial.println("GET  /api/dishwasher - Get dishwasher cycle state");
+  Serial.println("GET  /api/history?from=&to=&bucket=hour|day - Get usage history");
+  Serial.println("GET  /api/shopping?since=&epoch= - Get shopping list (or changes since)");
+  Serial.println("POST /api/shopping/add - Add shopping item");
+  Serial.println("POST /api/shopping/update - Update shopping item");
+  Serial.println("POST /api/shopping/remove - Remove shopping item");
+  Serial.println("POST /api/shopping/sync - Merge offline changes and get changes since");
+  Serial.println("GET  /api/display - Get OLED framebuffer as PBM image");
+  Serial.println("POST /api/alarm/stop - Silence the timer alarm");
+  Serial.println("POST /api/ota - Upload new firmware (X-OTA-Token header, optional X-SHA256)");
+  Serial.println("GET  /api/stats - Scheduler statistics");
 
   server.begin();
+  // Heap use is counted for the task that runs the scheduler
+  accountedTask = xTaskGetCurrentTaskHandle();
+
+  // Buttons are polled often enough to keep debouncing accurate; the network
+  // task gets a bounded slice so a slow client cannot delay them
+  addTask("lightButton", handleLightButton, 5000, 200, 0);
+  addTask("timerButton", handleTimerButton, 5000, 200, 0);
+  addTask("network", serviceNetwork, 2000, networkBudget, 1);
+  addTask("timer", serviceTimer, 100000, 200, 1);
+  startTimerControls();
+  addTask("encoder", serviceEncoder, 10000, 200, 1);
+  if (startAlarmOutput()) {
+    addTask("audio", serviceAudio, 10000, 1000, 0);
+  }
+  if (displayReady) {
+    addTask("display", serviceDisplay, 50000, 4000, 3);
+  }
+  replicationReady = startReplication();
+  if (replicationReady) {
+    addTask("replication", serviceReplication, 50000, 1000, 2);
+  }
+  shoppingStoreReady = startShoppingStore();
+  loadStaticManifest();
+  configTime(0, 0, "pool.ntp.org");
+  startHistoryLog();
+  if (shoppingStoreReady && strlen(shoppingUpstreamUrl) > 0 && startShoppingUpstream()) {
+    addTask("shoppingUpstream", serviceShoppingUpstream, 500000, 100000, 4);
+  }
+  if (startDishwasherSampling()) {
+    addTask("dishwasher", serviceDishwasherSensor, 20000, 1000, 2);
+  }
+  addTask("ota", serviceOta, 2000, 5000, 1);
+  addTask("heapGauge", serviceHeapGauge, 1000000, 1000, 5);
+  addTask("history", serviceHistory, 1000000, 60000, 6);
+  schedulerStartTime = monotonicMicros();
+
+  // Connected and serving: the boot check has passed
+  if (otaPendingVerify) {
+    esp_ota_mark_app_valid_cancel_rollback();
+    otaPendingVerify = false;
+    Serial.println("New firmware verified");
+  }
+}
+
+// The core marks every image valid before setup() unless this returns true;
+// setup() does it once the hub is actually on the network
+extern "C" bool verifyRollbackLater() {
+  return true;
 }
 
 void loop(){
+  runScheduler();
+}
+
+uint64_t monotonicMicros() {
+  return (uint64_t)esp_timer_get_time();
+}
 
-  handleLightButton();
+// Heap ordering: earliest deadline first, then priority
+bool taskBefore(int a, int b) {
+  if (tasks[a].deadline != tasks[b].deadline) {
+    return tasks[a].deadline < tasks[b].deadline;
+  }
+  return tasks[a].priority < tasks[b].priority;
+}
+
+void siftTaskDown(int pos) {
+  while (true) {
+    int left = 2 * pos + 1;
+    int right = left + 1;
+    int smallest = pos;
+    if (left < taskCount && taskBefore(taskHeap[left], taskHeap[smallest])) {
+      smallest = left;
+    }
+    if (right < taskCount && taskBefore(taskHeap[right], taskHeap[smallest])) {
+      smallest = right;
+    }
+    if (smallest == pos) {
+      return;
+    }
+    int swap = taskHeap[pos];
+    taskHeap[pos] = taskHeap[smallest];
+    taskHeap[smallest] = swap;
+    pos = smallest;
+  }
+}
+
+void siftTaskUp(int pos) {
+  while (pos > 0) {
+    int parent = (pos - 1) / 2;
+    if (!taskBefore(taskHeap[pos], taskHeap[parent])) {
+      return;
+    }
+    int swap = taskHeap[pos];
+    taskHeap[pos] = taskHeap[parent];
+    taskHeap[parent] = swap;
+    pos = parent;
+  }
+}
+
+bool addTask(const char* name, TaskFunction run, uint64_t period, uint64_t budget, uint8_t priority) {
+  if (taskCount >= maxTasks) {
+    Serial.print("Scheduler full, dropping task ");
+    Serial.println(name);
+    return false;
+  }
+  ScheduledTask& task = tasks[taskCount];
+  task = ScheduledTask();
+  task.name = name;
+  task.run = run;
+  task.period = period;
+  task.budget = budget;
+  task.priority = priority;
+  task.deadline = monotonicMicros();
+  taskHeap[taskCount] = taskCount;
+  taskCount++;
+  siftTaskUp(taskCount - 1);
+  return true;
+}
+
+void runScheduler() {
+  if (taskCount == 0) {
+    return;
+  }
+
+  uint64_t now = monotonicMicros();
+  ScheduledTask& task = tasks[taskHeap[0]];
+
+  if (task.deadline > now) {
+    // Nothing due. Sleep through waits of a tick or more so the idle task and
+    // WiFi stack get the CPU, and count the time as idle.
+    if (task.deadline - now >= 1000) {
+      delay(1);
+    } else {
+      yield();
+    }
+    idleTime += monotonicMicros() - now;
+    return;
+  }
+
+  uint64_t lateness = now - task.deadline;
+  if (lateness > task.maxLateness) {
+    task.maxLateness = lateness;
+  }
+
+  task.run(now + task.budget);
+
+  uint64_t finished = monotonicMicros();
+  uint64_t runTime = finished - now;
+  task.runs++;
+  if (runTime > task.maxRunTime) {
+    task.maxRunTime = runTime;
+  }
+  if (runTime > schedulerMaxRun) {
+    schedulerMaxRun = runTime;
+  }
+  if (runTime > task.budget) {
+    task.overruns++;
+  }
 
-  handleTimerButton();
+  // Keep the cadence fixed; if we fell a whole period behind, skip ahead
+  // instead of running the task back to back to catch up
+  task.deadline += task.period;
+  if (task.deadline <= finished) {
+    task.missedDeadlines++;
+    task.deadline = finished + task.period;
+  }
+  siftTaskDown(0);
+}
 
-  // Handle WiFi client requests
-  WiFiClient client = server.available();
+void serviceNetwork(uint64_t sliceEnd) {
+  // A dashboard file being sent holds the connection until it is done
+  if (staticFile) {
+    if (streamStaticFile(activeClient, sliceEnd)) {
+      closeClient();
+    }
+    return;
+  }
 
-  if (client) {
-    currentTime = millis();
-    previousTime = currentTime;
+  if (!clientActive) {
+    uint32_t allocationsBefore = heapAllocations;
+    activeClient = server.available();
+    connectionAllocations += heapAllocations - allocationsBefore;
+    if (!activeClient) {
+      return;
+    }
+    clientActive = true;
+    clientStartTime = monotonicMicros();
     Serial.println("New API Client.");
-    String currentLine = "";
-    String requestBody = "";
-    bool isPostRequest = false;
-    int contentLength = 0;
-
-    while (client.connected() && currentTime - previousTime <= timeoutTime) {
-      currentTime = millis();
-      if (client.available()) {
-        char c = client.read();
-        header += c;
-
-        if (c == '\n') {
-          if (currentLine.length() == 0) {
-            // End of headers, handle the request
-            handleAPIRequest(client, header, requestBody);
-            break;
-          } else {
-            // Check for POST request and Content-Length
-            if (currentLine.startsWith("POST")) {
-              isPostRequest = true;
-            }
-            if (currentLine.startsWith("Content-Length: ")) {
-              contentLength = currentLine.substring(16).toInt();
-            }
-            currentLine = "";
-          }
-        } else if (c != '\r') {
-          currentLine += c;
-        }
+    resetHttpRequest(httpRequest);
+  }
+
+  if (!activeClient.connected() || monotonicMicros() - clientStartTime > timeoutTime) {
+    Serial.println("API Client closed or timed out before request completed.");
+    closeClient();
+    return;
+  }
+
+  WiFiClientConnection connection(activeClient);
+  switch (readHttpRequest(httpRequest, connection, "POST /api/ota", sliceEnd, monotonicMicros)) {
+    case httpReading:
+      // Out of budget or waiting on the client: resume on the next slice
+      return;
+    case httpUploadReady:
+      // A firmware upload is handed to the OTA task with its body still unread
+      startOtaUpload(activeClient, httpRequest.header, httpRequest.contentLength);
+      clientActive = false;
+      return;
+    case httpHeadersTooLarge:
+      sendJsonError(activeClient, "431 Request Header Fields Too Large", "Request headers too large");
+      break;
+    case httpBodyTooLarge:
+      sendJsonError(activeClient, "413 Payload Too Large", "Request body too large");
+      break;
+    case httpRequestReady:
+      serveRequest(activeClient);
+      if (staticFile) {
+        // The response body goes out over the next slices
+        return;
       }
-    }
+      break;
+  }
+  closeClient();
+}
 
-    // Clear the header variable
-    header = "";
-    // Close the connection
-    client.stop();
-    Serial.println("API Client disconnected.\n");
+void closeClient() {
+  uint32_t allocationsBefore = heapAllocations;
+  activeClient.stop();
+  connectionAllocations += heapAllocations - allocationsBefore;
+  clientActive = false;
+  Serial.println("API Client disconnected.\n");
+}
+
+// Runs the handler for the buffered request and charges the heap use it
+// caused to its route
+void serveRequest(WiFiClient& client) {
+  RouteStats* route = findRoute(routeStats, routeCount, httpRequest.header);
+  uint32_t allocationsBefore = heapAllocations;
+  uint32_t bytesBefore = heapAllocatedBytes;
+  handleAPIRequest(client, httpRequest.header, httpRequest.body);
+  chargeRoute(*route, heapAllocations - allocationsBefore, heapAllocatedBytes - bytesBefore);
+}
+
+#if CONFIG_HEAP_USE_HOOKS
+// Called by IDF inside every malloc and free, possibly with the flash cache
+// disabled, so they stay in IRAM and only bump counters
+extern "C" void IRAM_ATTR esp_heap_trace_alloc_hook(void* ptr, size_t size, uint32_t caps) {
+  if (!xPortInIsrContext() && xTaskGetCurrentTaskHandle() == accountedTask) {
+    heapAllocations = heapAllocations + 1;
+    heapAllocatedBytes = heapAllocatedBytes + size;
+  }
+}
+
+extern "C" void IRAM_ATTR esp_heap_trace_free_hook(void* ptr) {
+  if (!xPortInIsrContext() && xTaskGetCurrentTaskHandle() == accountedTask) {
+    heapFrees = heapFrees + 1;
   }
 }
+#endif
+
+bool heapHooksEnabled() {
+#if CONFIG_HEAP_USE_HOOKS
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Samples free memory and the largest free block. A largest block that keeps
+// shrinking while free memory holds steady means the heap is fragmenting.
+void serviceHeapGauge(uint64_t sliceEnd) {
+  heapFreeBytes = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  heapLargestBlock = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  heapFragmentation = heapFreeBytes > 0 ? 100 - (uint64_t)heapLargestBlock * 100 / heapFreeBytes : 0;
+  minHeapLargestBlock = min(minHeapLargestBlock, heapLargestBlock);
+  maxHeapFragmentation = max(maxHeapFragmentation, heapFragmentation);
+}
 
-void handleTimerButton() {
+void handleTimerButton(uint64_t sliceEnd) {
   bool reading = digitalRead(timerButton);
+  uint64_t now = monotonicMicros();
 
   if (reading != lastTimerButtonState) {
-    lastTimerDebounceTime = millis();
+    lastTimerDebounceTime = now;
   }
 
-  if ((millis() - lastTimerDebounceTime) > timerDebounceDelay) {
+  if ((now - lastTimerDebounceTime) > timerDebounceDelay) {
     if (reading != currentTimerButtonState) {
       currentTimerButtonState = reading;
 
@@ -182,29 +733,404 @@ void handleTimerButton() {
 }
 
 void toggleTimer() {
+  if (alarmPlaying) {
+    // The first press after the timer finishes only silences the alarm
+    stopAlarm();
+    Serial.println("Timer Button: Alarm SILENCED");
+    return;
+  }
+
   if (timerState == "stopped") {
-    timerState = "running";
+    setTimerState("running");
     Serial.println("Timer Button: Timer STARTED");
   } else if (timerState == "running") {
-    timerState = "paused";
+    setTimerState("paused");
     Serial.println("Timer Button: Timer PAUSED");
   } else if (timerState == "paused") {
-    timerState = "running";
+    setTimerState("running");
     Serial.println("Timer Button: Timer RESUMED");
   }
 }
 
-void handleLightButton() {
+void setTimerState(const char* newState) {
+  uint64_t now = monotonicMicros();
+  bool toRunning = strcmp(newState, "running") == 0;
+  bool toPaused = strcmp(newState, "paused") == 0;
+
+  if (toRunning && timerState != "running") {
+    if (timerState == "stopped") {
+      timerElapsed = 0;
+    }
+    timerResumedAt = now;
+  } else if (toPaused && timerState == "running") {
+    timerElapsed += now - timerResumedAt;
+  } else if (strcmp(newState, "stopped") == 0 && timerState != "stopped") {
+    uint64_t ran = timerElapsed + (timerState == "running" ? now - timerResumedAt : 0);
+    recordHistory(ran >= timerDuration ? eventTimerFinished : eventTimerStop, ran / 1000000);
+    timerElapsed = 0;
+  }
+
+  if (timerState != newState) {
+    if (toRunning) {
+      recordHistory(timerState == "paused" ? eventTimerResume : eventTimerStart, 0);
+    } else if (toPaused) {
+      recordHistory(eventTimerPause, 0);
+    }
+  }
+  // Short state names fit the String's inline buffer: no allocation
+  timerState = newState;
+}
+
+uint64_t timerRemaining() {
+  uint64_t elapsed = timerElapsed;
+  if (timerState == "running") {
+    elapsed += monotonicMicros() - timerResumedAt;
+  }
+  return elapsed >= timerDuration ? 0 : timerDuration - elapsed;
+}
+
+uint32_t timerRemainingSeconds() {
+  // Round up so the display reads 00:00 only once the timer is done
+  return (uint32_t)((timerRemaining() + 999999) / 1000000);
+}
+
+void serviceTimer(uint64_t sliceEnd) {
+  if (timerState == "running" && timerRemaining() == 0) {
+    setTimerState("stopped");
+    Serial.println("Timer: Timer FINISHED");
+    startAlarm();
+  }
+}
+
+bool IRAM_ATTR onI2sUnderrun(i2s_chan_handle_t handle, i2s_event_data_t* event, void* context) {
+  // The ring runs dry on purpose at the end of the clip
+  if (!alarmDraining) {
+    audioUnderruns++;
+  }
+  return false;
+}
+
+// Finds the clip and sets up the I2S channel; playback starts on demand
+bool startAlarmOutput() {
+  alarmPartition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "alarm");
+  if (alarmPartition == NULL || !findAlarmClip()) {
+    Serial.println("Alarm clip not found, alarm disabled");
+    return false;
+  }
+
+  // On the classic ESP32 the ADC's continuous mode takes I2S0 for its DMA,
+  // so the alarm keeps to I2S1 and both can run
+  i2s_chan_config_t channelConfig = I2S_CHANNEL_DEFAULT_CONFIG(I2S_NUM_1, I2S_ROLE_MASTER);
+  channelConfig.dma_desc_num = audioDmaBuffers;
+  channelConfig.dma_frame_num = audioDmaFrames;
+  // Play silence rather than repeating stale buffers if we ever fall behind
+  channelConfig.auto_clear = true;
+
+  i2s_std_config_t stdConfig = {};
+  stdConfig.clk_cfg = I2S_STD_CLK_DEFAULT_CONFIG(alarmSampleRate);
+  stdConfig.slot_cfg = I2S_STD_PHILIPS_SLOT_DEFAULT_CONFIG(I2S_DATA_BIT_WIDTH_16BIT, I2S_SLOT_MODE_MONO);
+  stdConfig.gpio_cfg.mclk = I2S_GPIO_UNUSED;
+  stdConfig.gpio_cfg.bclk = i2sBclk;
+  stdConfig.gpio_cfg.ws = i2sWs;
+  stdConfig.gpio_cfg.dout = i2sDout;
+  stdConfig.gpio_cfg.din = I2S_GPIO_UNUSED;
+
+  i2s_event_callbacks_t callbacks = {};
+  callbacks.on_send_q_ovf = onI2sUnderrun;
+
+  esp_err_t err = i2s_new_channel(&channelConfig, &i2sTx, NULL);
+  if (err == ESP_OK) {
+    err = i2s_channel_init_std_mode(i2sTx, &stdConfig);
+  }
+  if (err == ESP_OK) {
+    err = i2s_channel_register_event_callback(i2sTx, &callbacks, NULL);
+  }
+  if (err != ESP_OK) {
+    Serial.print("Error: alarm could not claim I2S1, alarm disabled: ");
+    Serial.println(esp_err_to_name(err));
+    return false;
+  }
+  return true;
+}
+
+// Walks the WAV chunks to find the format and the PCM data
+bool findAlarmClip() {
+  uint8_t riff[12];
+  if (esp_partition_read(alarmPartition, 0, riff, sizeof(riff)) != ESP_OK ||
+      memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0) {
+    return false;
+  }
+
+  uint32_t offset = sizeof(riff);
+  bool formatOk = false;
+  for (int chunks = 0; chunks < 16 && offset + 8 <= alarmPartition->size; chunks++) {
+    uint8_t chunkHeader[8];
+    esp_partition_read(alarmPartition, offset, chunkHeader, sizeof(chunkHeader));
+    uint32_t chunkSize = chunkHeader[4] | (chunkHeader[5] << 8) | (chunkHeader[6] << 16) | ((uint32_t)chunkHeader[7] << 24);
+    offset += sizeof(chunkHeader);
+
+    if (memcmp(chunkHeader, "fmt ", 4) == 0) {
+      uint8_t format[16];
+      esp_partition_read(alarmPartition, offset, format, sizeof(format));
+      uint16_t encoding = format[0] | (format[1] << 8);
+      uint16_t channels = format[2] | (format[3] << 8);
+      uint16_t bits = format[14] | (format[15] << 8);
+      alarmSampleRate = format[4] | (format[5] << 8) | (format[6] << 16) | ((uint32_t)format[7] << 24);
+      formatOk = encoding == 1 && channels == 1 && bits == 16;
+      if (!formatOk) {
+        Serial.println("Alarm clip must be 16-bit mono PCM");
+        return false;
+      }
+    } else if (memcmp(chunkHeader, "data", 4) == 0) {
+      alarmDataOffset = offset;
+      alarmDataSize = min(chunkSize, alarmPartition->size - offset);
+      return formatOk;
+    }
+    // Chunks are padded to an even size
+    offset += chunkSize + (chunkSize & 1);
+  }
+  return false;
+}
+
+void startAlarm() {
+  if (i2sTx == NULL || alarmPlaying) {
+    return;
+  }
+  alarmPlaysLeft = alarmRepeats;
+  alarmReadOffset = 0;
+  audioFrontLength = 0;
+  audioFrontSent = 0;
+  audioBackReady = false;
+  alarmDraining = false;
+  alarmStartedAt = monotonicMicros();
+  alarmPlaying = true;
+  i2s_channel_enable(i2sTx);
+  Serial.println("Alarm: Playing");
+}
+
+void stopAlarm() {
+  if (!alarmPlaying) {
+    return;
+  }
+  alarmPlaying = false;
+  alarmDraining = false;
+  audioPlayTime += monotonicMicros() - alarmStartedAt;
+  i2s_channel_disable(i2sTx);
+  Serial.println("Alarm: Stopped");
+}
+
+// Reads the next chunk of the clip into the back buffer; false once every repeat is read
+bool fillAudioBackBuffer() {
+  if (alarmReadOffset >= alarmDataSize) {
+    if (--alarmPlaysLeft <= 0) {
+      return false;
+    }
+    alarmReadOffset = 0;
+  }
+  uint32_t length = min((uint32_t)audioChunkBytes, alarmDataSize - alarmReadOffset);
+  esp_partition_read(alarmPartition, alarmDataOffset + alarmReadOffset, audioBuffers[1 - audioFront], length);
+  alarmReadOffset += length;
+  audioBackLength = length;
+  audioBackReady = true;
+  audioChunksRead++;
+  return true;
+}
+
+void serviceAudio(uint64_t sliceEnd) {
+  if (!alarmPlaying) {
+    return;
+  }
+  uint64_t start = monotonicMicros();
+  if (alarmDraining) {
+    if (start >= alarmDrainUntil) {
+      stopAlarm();
+    }
+    return;
+  }
+
+  while (monotonicMicros() < sliceEnd) {
+    if (audioFrontSent == audioFrontLength) {
+      // Front buffer is done: swap in the back buffer (reading it now if it
+      // was not prefetched)
+      if (!audioBackReady && !fillAudioBackBuffer()) {
+        // Everything is queued; at most a full ring is still to play
+        alarmDraining = true;
+        alarmDrainUntil = monotonicMicros() +
+          (uint64_t)audioDmaBuffers * audioDmaFrames * 1000000 / alarmSampleRate;
+        break;
+      }
+      audioFront = 1 - audioFront;
+      audioFrontLength = audioBackLength;
+      audioFrontSent = 0;
+      audioBackReady = false;
+    }
+
+    // Timeout 0: copy whatever fits in the DMA ring and return
+    size_t written = 0;
+    i2s_channel_write(i2sTx, audioBuffers[audioFront] + audioFrontSent,
+                      audioFrontLength - audioFrontSent, &written, 0);
+    audioFrontSent += written;
+
+    if (audioFrontSent < audioFrontLength) {
+      // DMA ring is full; prefetch the next chunk while it drains
+      if (!audioBackReady) {
+        fillAudioBackBuffer();
+      }
+      break;
+    }
+  }
+
+  audioBusyTime += monotonicMicros() - start;
+}
+
+void IRAM_ATTR onEncoderChange() {
+  // Indexed by (previous AB << 2) | current AB; invalid (bounced) transitions count 0
+  static const int8_t transitions[16] = {0, -1, 1, 0, 1, 0, 0, -1, -1, 0, 0, 1, 0, 1, -1, 0};
+  uint8_t state = (digitalRead(encoderPinA) << 1) | digitalRead(encoderPinB);
+  encoderCount += transitions[(encoderLastState << 2) | state];
+  encoderLastState = state;
+}
+
+void startTimerControls() {
+  pinMode(encoderPinA, INPUT_PULLUP);
+  pinMode(encoderPinB, INPUT_PULLUP);
+  encoderLastState = (digitalRead(encoderPinA) << 1) | digitalRead(encoderPinB);
+  attachInterrupt(digitalPinToInterrupt(encoderPinA), onEncoderChange, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(encoderPinB), onEncoderChange, CHANGE);
+
+  Wire.begin(oledSda, oledScl, 400000);
+  displayReady = startDisplay();
+  if (!displayReady) {
+    Serial.println("OLED display not found");
+  }
+}
+
+void serviceEncoder(uint64_t sliceEnd) {
+  int32_t detents = (encoderCount - encoderConsumed) / 4;
+  if (detents == 0) {
+    return;
+  }
+  encoderConsumed += detents * 4;
+
+  // Presets only change while the timer is stopped so a bump cannot alter a running countdown
+  if (timerState != "stopped") {
+    return;
+  }
+  timerPresetIndex = constrain(timerPresetIndex + detents, 0, timerPresetCount - 1);
+  timerDuration = (uint64_t)timerPresets[timerPresetIndex] * 1000000;
+  Serial.print("Encoder: Timer duration set to ");
+  Serial.print(timerPresets[timerPresetIndex] / 60);
+  Serial.println(" minutes");
+}
+
+bool startDisplay() {
+  static const uint8_t initCommands[] = {
+    0xAE,       // Display off
+    0xD5, 0x80, // Clock divide
+    0xA8, 0x3F, // 64 rows
+    0xD3, 0x00, // No display offset
+    0x40,       // Start line 0
+    0x8D, 0x14, // Charge pump on
+    0x20, 0x00, // Horizontal addressing
+    0xA1,       // Segment remap
+    0xC8,       // COM scan descending
+    0xDA, 0x12, // COM pins
+    0x81, 0x8F, // Contrast
+    0xD9, 0xF1, // Precharge
+    0xDB, 0x40, // VCOM detect
+    0xA4,       // Display from RAM
+    0xA6,       // Normal (not inverted)
+    0xAF        // Display on
+  };
+  Wire.beginTransmission(oledAddress);
+  Wire.write((uint8_t)0x00);
+  Wire.write(initCommands, sizeof(initCommands));
+  if (Wire.endTransmission() != 0) {
+    return false;
+  }
+
+  // The panel powers up with random RAM; invert the shadow so the first
+  // flush sends every byte
+  memset(displayBuffer, 0, sizeof(displayBuffer));
+  memset(displayShadow, 0xFF, sizeof(displayShadow));
+  return true;
+}
+
+void serviceDisplay(uint64_t sliceEnd) {
+  uint32_t seconds = timerRemainingSeconds();
+  if (seconds != displayedSeconds || timerState != displayedTimerState ||
+      timerPresetIndex != displayedPresetIndex) {
+    renderTimerScreen(displayBuffer, seconds, timerState.c_str(), timerPresets[timerPresetIndex]);
+    displayedSeconds = seconds;
+    displayedTimerState = timerState;
+    displayedPresetIndex = timerPresetIndex;
+  }
+
+  // One page is ~3 ms on the bus at 400 kHz; stop between pages when the
+  // slice is spent and finish on the next run
+  for (int page = 0; page < displayPages && monotonicMicros() < sliceEnd; page++) {
+    flushDisplayPage(page);
+  }
+}
+
+// Sends the changed column range of one page, if any
+void flushDisplayPage(int page) {
+  uint8_t* rendered = &displayBuffer[page * displayWidth];
+  uint8_t* shown = &displayShadow[page * displayWidth];
+  int first = 0;
+  while (first < displayWidth && rendered[first] == shown[first]) {
+    first++;
+  }
+  if (first == displayWidth) {
+    return;
+  }
+  int last = displayWidth - 1;
+  while (rendered[last] == shown[last]) {
+    last--;
+  }
+
+  Wire.beginTransmission(oledAddress);
+  Wire.write((uint8_t)0x00);
+  Wire.write((uint8_t)0x21); // Column range
+  Wire.write((uint8_t)first);
+  Wire.write((uint8_t)last);
+  Wire.write((uint8_t)0x22); // Page range
+  Wire.write((uint8_t)page);
+  Wire.write((uint8_t)page);
+  Wire.endTransmission();
+
+  // Wire buffers up to 128 bytes per transmission, including the control byte
+  const int chunk = 64;
+  for (int column = first; column <= last; column += chunk) {
+    int length = min(chunk, last - column + 1);
+    Wire.beginTransmission(oledAddress);
+    Wire.write((uint8_t)0x40);
+    Wire.write(&rendered[column], length);
+    Wire.endTransmission();
+    displayBytesSent += length;
+  }
+  memcpy(&shown[first], &rendered[first], last - first + 1);
+}
+
+// Writes the framebuffer as a plain-text PBM image
+void dumpFramebuffer(Print& out) {
+  writePbm(displayBuffer, [](void* context, const char* data, size_t length) {
+    ((Print*)context)->write((const uint8_t*)data, length);
+  }, &out);
+}
+
+void handleLightButton(uint64_t sliceEnd) {
   // Read the button state
   bool reading = digitalRead(lightButton);
+  uint64_t now = monotonicMicros();
 
   // If the switch changed, due to noise or pressing:
   if (reading != lastLightButtonState) {
     // Reset the debouncing timer
-    lastDebounceTime = millis();
+    lastDebounceTime = now;
   }
 
-  if ((millis() - lastDebounceTime) > debounceDelay) {
+  if ((now - lastDebounceTime) > debounceDelay) {
     // If the button state has changed:
     if (reading != currentLightButtonState) {
       currentLightButtonState = reading;
@@ -245,634 +1171,1177 @@ void toggleLights() {
     greenLightState = "on";
     Serial.println("Button: Green light (clean) turned ON");
   }
+  recordHistory(greenLightState == "on" ? eventDishesClean : eventDishesDirty, 0);
+}
+
+bool IRAM_ATTR onAdcPoolOverflow(adc_continuous_handle_t handle, const adc_continuous_evt_data_t* data, void* context) {
+  adcPoolOverflows++;
+  return false;
 }
 
-void handleAPIRequest(WiFiClient& client, String& request, String& body) {
-  // Set CORS headers to allow cross-origin requests
-  String response = "HTTP/1.1 ";
-  String contentType = "Content-Type: application/json\r\n";
-  String corsHeaders = "Access-Control-Allow-Origin: *\r\n";
-  corsHeaders += "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n";
-  corsHeaders += "Access-Control-Allow-Headers: Content-Type\r\n";
+bool startDishwasherSampling() {
+  resetDishwasherDetector(dishwasher);
 
-  // Handle OPTIONS request for CORS preflight
-  if (request.indexOf("OPTIONS") >= 0) {
-    response += "200 OK\r\n";
-    response += corsHeaders;
-    response += "Content-Length: 0\r\n\r\n";
-    client.print(response);
-    return;
-  }
+  adc_continuous_handle_cfg_t handleConfig = {};
+  handleConfig.max_store_buf_size = 4 * adcFrameBytes;
+  handleConfig.conv_frame_size = adcFrameBytes;
+  esp_err_t err = adc_continuous_new_handle(&handleConfig, &adcHandle);
 
-  // GET /api/timer - Return current state of all lights
-  if (request.indexOf("GET /api/timer") >= 0) {
-    response += "200 OK\r\n";
-    response += contentType;
-    response += corsHeaders;
-    response += "\r\n";
+  adc_digi_pattern_config_t pattern = {};
+  pattern.atten = ADC_ATTEN_DB_12;
+  pattern.channel = ADC_CHANNEL_6;
+  pattern.unit = ADC_UNIT_1;
+  pattern.bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
 
-    DynamicJsonDocument doc(200);
-    doc["status"] = "success";
-    doc["timer"] = timerState;
+  adc_continuous_config_t config = {};
+  config.pattern_num = 1;
+  config.adc_pattern = &pattern;
+  config.sample_freq_hz = adcSampleRate;
+  config.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+  config.format = ADC_DIGI_OUTPUT_FORMAT_TYPE1;
 
-    String jsonString;
-    serializeJson(doc, jsonString);
-    response += jsonString;
+  adc_continuous_evt_cbs_t callbacks = {};
+  callbacks.on_pool_ovf = onAdcPoolOverflow;
 
-    client.print(response);
-    Serial.println("Sent timer state");
-    return;
+  if (err == ESP_OK) {
+    err = adc_continuous_config(adcHandle, &config);
   }
-  // POST /api/timer/start - Start timer
-  if (request.indexOf("POST /api/timer/start") >= 0) {
-    timerState = "running";
-    response += "200 OK\r\n";
-    response += contentType;
-    response += corsHeaders;
-    response += "\r\n";
-
-    DynamicJsonDocument doc(200);
-    doc["status"] = "success";
-    doc["message"] = "Timer started";
-    doc["timer"] = timerState;
+  if (err == ESP_OK) {
+    err = adc_continuous_register_event_callbacks(adcHandle, &callbacks, NULL);
+  }
+  if (err == ESP_OK) {
+    err = adc_continuous_start(adcHandle);
+  }
+  if (err != ESP_OK) {
+    Serial.print("Error: dishwasher sensor could not claim the ADC, detection disabled: ");
+    Serial.println(esp_err_to_name(err));
+    return false;
+  }
+  return true;
+}
 
-    String jsonString;
-    serializeJson(doc, jsonString);
-    response += jsonString;
+// Drains finished DMA frames into the sample ring, then runs feature
+// extraction on every full window while the slice lasts
+void serviceDishwasherSensor(uint64_t sliceEnd) {
+  uint32_t bytesRead = 0;
+  while (monotonicMicros() < sliceEnd &&
+         adc_continuous_read(adcHandle, adcFrame, adcFrameBytes, &bytesRead, 0) == ESP_OK) {
+    for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= bytesRead; i += SOC_ADC_DIGI_RESULT_BYTES) {
+      adc_digi_output_data_t* result = (adc_digi_output_data_t*)&adcFrame[i];
+      decimationSum += result->type1.data;
+      if (++decimationCount == adcDecimation) {
+        pushSample(decimationSum / adcDecimation);
+        decimationSum = 0;
+        decimationCount = 0;
+      }
+    }
+  }
 
-    client.print(response);
-    Serial.println("API: Timer started");
-    return;
+  while (monotonicMicros() < sliceEnd && sampleRingHead - sampleRingTail >= (uint32_t)dspWindowSize) {
+    for (int i = 0; i < dspWindowSize; i++) {
+      dspWindow[i] = sampleRing[(sampleRingTail + i) & (sampleRingSize - 1)];
+    }
+    sampleRingTail += dspWindowSize;
+    handleCycleEvent(processDishwasherWindow(dishwasher, dspWindow, dspWindowSize));
   }
+}
 
-  // POST /api/timer/pause - Pause timer
-  if (request.indexOf("POST /api/timer/pause") >= 0) {
-    timerState = "paused";
-    response += "200 OK\r\n";
-    response += contentType;
-    response += corsHeaders;
-    response += "\r\n";
-
-    DynamicJsonDocument doc(200);
-    doc["status"] = "success";
-    doc["message"] = "Timer paused";
-    doc["timer"] = timerState;
+void pushSample(int16_t sample) {
+  if (sampleRingHead - sampleRingTail >= sampleRingSize) {
+    // Feature extraction fell behind; drop the oldest sample
+    sampleRingTail++;
+    droppedSamples++;
+  }
+  sampleRing[sampleRingHead & (sampleRingSize - 1)] = sample;
+  sampleRingHead++;
+}
 
-    String jsonString;
-    serializeJson(doc, jsonString);
-    response += jsonString;
+void handleCycleEvent(CycleEvent event) {
+  if (event == cycleStarted) {
+    Serial.println("Dishwasher: Cycle STARTED");
+  } else if (event == cycleIgnored) {
+    Serial.println("Dishwasher: Activity too short for a cycle, ignored");
+  } else if (event == cycleFinished) {
+    digitalWrite(greenLight, HIGH);
+    digitalWrite(redLight, LOW);
+    greenLightState = "on";
+    redLightState = "off";
+    recordHistory(eventCycleComplete, dishwasher.lastCycleSeconds);
+    recordHistory(eventDishesClean, 0);
+    Serial.print("Dishwasher: Cycle FINISHED after ");
+    Serial.print(dishwasher.lastCycleSeconds / 60);
+    Serial.println(" minutes, green light (clean) turned ON");
+  }
+}
 
-    client.print(response);
-    Serial.println("API: Timer paused");
-    return;
+// LittleFS backing for the shopping store. The append handle stays open, so
+// logging a change costs a write and a flush instead of an open and a close.
+class LittleFsShoppingLog : public ShoppingLog {
+ public:
+  // Opens the log for replay, settling a compaction cut short by a power loss
+  void open() {
+    if (shoppingFs.exists(shoppingTempPath)) {
+      // Compaction renames the temp file over the log in one step, so next to
+      // a log the temp file is an unfinished rewrite. Older firmware removed
+      // the log first; without a log the temp file is the only copy.
+      if (shoppingFs.exists(shoppingLogPath)) {
+        shoppingFs.remove(shoppingTempPath);
+      } else {
+        shoppingFs.rename(shoppingTempPath, shoppingLogPath);
+      }
+    }
+    replayFile = shoppingFs.open(shoppingLogPath, "r");
+  }
+  size_t read(uint8_t* data, size_t length) override {
+    return replayFile ? replayFile.read(data, length) : 0;
+  }
+  bool append(const uint8_t* data, size_t length) override {
+    if (!appendFile) {
+      replayFile.close();
+      appendFile = shoppingFs.open(shoppingLogPath, "a");
+      if (!appendFile) {
+        return false;
+      }
+    }
+    bool ok = appendFile.write(data, length) == length;
+    // flush() also syncs the file, so the record survives a power loss
+    appendFile.flush();
+    return ok;
+  }
+  bool beginRewrite() override {
+    rewriteFile = shoppingFs.open(shoppingTempPath, "w");
+    return (bool)rewriteFile;
+  }
+  bool rewrite(const uint8_t* data, size_t length) override {
+    return rewriteFile.write(data, length) == length;
+  }
+  bool endRewrite(bool commit) override {
+    rewriteFile.close();
+    if (!commit) {
+      shoppingFs.remove(shoppingTempPath);
+      return true;
+    }
+    replayFile.close();
+    appendFile.close();
+    // LittleFS replaces an existing file atomically on rename
+    return shoppingFs.rename(shoppingTempPath, shoppingLogPath);
   }
 
-  // POST /api/timer/stop - Stop/reset timer
-  if (request.indexOf("POST /api/timer/stop") >= 0) {
-    timerState = "stopped";
-    response += "200 OK\r\n";
-    response += contentType;
-    response += corsHeaders;
-    response += "\r\n";
-
-    DynamicJsonDocument doc(200);
-    doc["status"] = "success";
-    doc["message"] = "Timer stopped";
-    doc["timer"] = timerState;
+ private:
+  File replayFile;
+  File appendFile;
+  File rewriteFile;
+};
 
-    String jsonString;
-    serializeJson(doc, jsonString);
-    response += jsonString;
+LittleFsShoppingLog shoppingLog;
 
-    client.print(response);
-    Serial.println("API: Timer stopped");
-    return;
+bool startShoppingStore() {
+  initShoppingStore(shopping, esp_random(), &shoppingLog);
+  if (!shoppingFs.begin(true, "/shopping", 4, "shopping")) {
+    Serial.println("Shopping partition mount failed, shopping list disabled");
+    return false;
   }
 
-  // GET /api/lights - Return current state of all lights
-  if (request.indexOf("GET /api/lights") >= 0) {
-    response += "200 OK\r\n";
-    response += contentType;
-    response += corsHeaders;
-    response += "\r\n";
-
-    // Create JSON response
-    DynamicJsonDocument doc(200);
-    doc["status"] = "success";
-    JsonObject lights = doc.createNestedObject("lights");
-    lights["red light"] = redLightState;
-    lights["green light"] = greenLightState;
-
-    String jsonString;
-    serializeJson(doc, jsonString);
-    response += jsonString;
+  shoppingLog.open();
+  if (!loadShoppingLog(shopping)) {
+    Serial.println("Shopping log damaged, keeping records up to the damage");
+  }
+  Serial.print("Shopping list loaded: ");
+  Serial.print(shopping.itemCount);
+  Serial.println(" items");
+  return true;
+}
 
-    client.print(response);
-    Serial.println("Sent light states");
-    return;
+// Applies one change object from a request or the upstream: {id, text,
+// completed, deleted, ts, replica}. Missing fields keep their current value.
+// Returns false if the change is invalid or could not be stored.
+bool applyShoppingJson(JsonVariant change, const char* defaultReplica, bool fromUpstream) {
+  const char* id = change["id"];
+  if (id == NULL || strlen(id) == 0 || strlen(id) >= sizeof(ShoppingItem::id)) {
+    return false;
   }
+  ShoppingItem* current = findShoppingItem(shopping, id);
+  const char* text = change["text"];
+  if (current == NULL && text == NULL) {
+    return false;
+  }
+  bool completed = change["completed"] | (current != NULL && current->completed);
+  bool deleted = change["deleted"] | (current != NULL && current->deleted);
+  uint64_t timestamp = change["ts"] | (uint64_t)0;
+  // Phones name their replica; the upstream sends back the hash we gave it
+  JsonVariant replica = change["replica"];
+  uint32_t replicaId = replica.is<uint32_t>() ? replica.as<uint32_t>() : replicaHash(replica | defaultReplica);
+  return applyShoppingChange(shopping, id, text, completed, deleted, timestamp, replicaId, fromUpstream);
+}
 
-  // POST requests for controlling lights
-  bool validRequest = false;
-  String responseMessage = "";
+void addShoppingItemJson(JsonArray items, const ShoppingItem& item) {
+  JsonObject entry = items.createNestedObject();
+  // Cast to const char* so ArduinoJson stores pointers instead of copies
+  entry["id"] = (const char*)item.id;
+  entry["text"] = (const char*)item.text;
+  entry["completed"] = item.completed;
+  entry["deleted"] = item.deleted;
+  entry["ts"] = item.timestamp;
+  entry["replica"] = item.replica;
+}
 
-  if (request.indexOf("POST /api/lights/red/on") >= 0) {
-    digitalWrite(redLight, HIGH);
-    digitalWrite(greenLight, LOW);  // Ensure only one light is on
-    redLightState = "on";
-    greenLightState = "off";
-    responseMessage = "Red light (GPIO18) turned ON";
-    validRequest = true;
-    Serial.println("API: Red light (GPIO18) turned ON");
+// Appends printf-style text to the response; anything past the buffer is cut
+void appendResponse(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  vappendHttpResponse(httpResponse, format, args);
+  va_end(args);
+}
 
-  } else if (request.indexOf("POST /api/lights/red/off") >= 0) {
-    digitalWrite(redLight, LOW);
-    redLightState = "off";
-    responseMessage = "Red light (GPIO18) OFF";
-    validRequest = true;
-    Serial.println("API: Red light (GPIO18) turned OFF");
+// Starts a response: status line, CORS headers and, unless NULL, the content type
+void beginResponse(const char* status, const char* contentType) {
+  beginHttpResponse(httpResponse, status, contentType, corsHeaders);
+}
 
-  } else if (request.indexOf("POST /api/lights/green/on") >= 0) {
-    digitalWrite(greenLight, HIGH);
-    digitalWrite(redLight, LOW);  // Ensure only one light is on
-    greenLightState = "on";
-    redLightState = "off";
-    responseMessage = "Green light (GPIO19) turned ON";
-    validRequest = true;
-    Serial.println("API: Green light (GPIO19) turned ON");
+void sendResponse(WiFiClient& client) {
+  WiFiClientConnection connection(client);
+  sendHttpResponse(httpResponse, connection);
+}
 
-  } else if (request.indexOf("POST /api/lights/green/off") >= 0) {
-    digitalWrite(greenLight, LOW);
-    greenLightState = "off";
-    responseMessage = "Green light (GPIO19) turned OFF";
-    validRequest = true;
-    Serial.println("API: Green light (GPIO19) turned OFF");
+// Print that collects output in httpResponse, sending it whenever it fills
+class ResponseWriter : public Print {
+ public:
+  explicit ResponseWriter(WiFiClient& client) : connection(client) {}
+  size_t write(uint8_t c) override {
+    return write(&c, 1);
+  }
+  size_t write(const uint8_t* data, size_t length) override {
+    writeHttpResponse(httpResponse, connection, data, length);
+    return length;
   }
 
-  if (validRequest) {
-    response += "200 OK\r\n";
-    response += contentType;
-    response += corsHeaders;
-    response += "\r\n";
+ private:
+  WiFiClientConnection connection;
+};
 
-    // Create success JSON response
-    DynamicJsonDocument doc(200);
-    doc["status"] = "success";
-    doc["message"] = responseMessage;
-    JsonObject lights = doc.createNestedObject("lights");
-    lights["red light"] = redLightState;
-    lights["green light"] = greenLightState;
+// Starts a JSON response whose body is written with the api_json builders
+void beginJsonResponse(JsonWriter& json, HttpConnection& connection, const char* status) {
+  beginResponse(status, "application/json");
+  appendResponse("\r\n");
+  startJson(json, httpResponse, connection);
+}
 
-    String jsonString;
-    serializeJson(doc, jsonString);
-    response += jsonString;
+void sendJson(WiFiClient& client, const char* status, JsonDocument& doc) {
+  beginResponse(status, "application/json");
+  appendResponse("\r\n");
+  ResponseWriter writer(client);
+  serializeJson(doc, writer);
+  sendResponse(client);
+}
 
-  } else {
-    // Invalid endpoint
-    response += "404 Not Found\r\n";
-    response += contentType;
-    response += corsHeaders;
-    response += "\r\n";
+// Cleared document for responses too large for the stack
+JsonDocument& largeResponse() {
+  responseDoc.clear();
+  return responseDoc;
+}
 
-    DynamicJsonDocument doc(150);
-    doc["status"] = "error";
-    doc["message"] = "Endpoint not found";
+void sendJsonError(WiFiClient& client, const char* status, const char* message) {
+  WiFiClientConnection connection(client);
+  JsonWriter json;
+  beginJsonResponse(json, connection, status);
+  writeErrorJson(json, message);
+  finishJson(json);
+}
 
-    String jsonString;
-    serializeJson(doc, jsonString);
-    response += jsonString;
+void handleShoppingRequest(WiFiClient& client, const char* request, char* body) {
+  if (!shoppingStoreReady) {
+    sendJsonError(client, "503 Service Unavailable", "Shopping list storage unavailable");
+    return;
   }
 
-  client.print(response);
-}
-// REPLACE WITH YOUR NETWORK CREDENTIALS BEFORE UPLOADING
-const char* ssid = "YOUR_WIFI_NETWORK";
-const char* password = "YOUR_WIFI_PASSWORD";
+  WiFiClientConnection connection(client);
+  JsonWriter json;
+  if (strstr(request, "GET /api/shopping")) {
+    beginJsonResponse(json, connection, "200 OK");
+    writeShoppingJson(json, shopping, queryParam(request, "epoch", 0), queryParam(request, "since", 0), -1);
+    finishJson(json);
+    Serial.println("Sent shopping list");
+    return;
+  }
 
+  // Parsed in place: strings stay in the body buffer rather than being copied
+  // into the document, which only has room for the nodes
+  JsonDocument& input = requestDoc;
+  DeserializationError error = deserializeJson(input, body);
+  if (error == DeserializationError::NoMemory) {
+    sendJsonError(client, "413 Payload Too Large", "Too many changes in one request");
+    return;
+  }
+  if (error) {
+    sendJsonError(client, "400 Bad Request", "Invalid JSON body");
+    return;
+  }
+  const char* replica = input["replica"] | "unknown";
+
+  // POST /api/shopping/sync - Merge a batch of offline changes, reply with changes since
+  if (strstr(request, "POST /api/shopping/sync")) {
+    JsonArray changes = input["changes"];
+    if (changes.size() > maxSyncChanges) {
+      sendJsonError(client, "413 Payload Too Large", "Too many changes in one sync");
+      return;
+    }
+    int rejected = 0;
+    for (JsonVariant change : changes) {
+      if (!applyShoppingJson(change, replica, false)) {
+        rejected++;
+      }
+    }
+    beginJsonResponse(json, connection, "200 OK");
+    writeShoppingJson(json, shopping, input["epoch"] | (uint32_t)0, input["since"] | (uint32_t)0, rejected);
+    finishJson(json);
+    Serial.println("API: Shopping list synced");
+    return;
+  }
 
-// Set web server port number to 80
-WiFiServer server(80);
+  // POST /api/shopping/add, /update, /remove - Single change
+  if (strstr(request, "POST /api/shopping/add")) {
+    if (!input.containsKey("id")) {
+      char id[sizeof(ShoppingItem::id)];
+      snprintf(id, sizeof(id), "%08lx%08lx", (unsigned long)esp_random(), (unsigned long)esp_random());
+      input["id"] = id;
+    }
+  } else if (strstr(request, "POST /api/shopping/remove")) {
+    input["deleted"] = true;
+  } else if (!strstr(request, "POST /api/shopping/update")) {
+    sendJsonError(client, "404 Not Found", "Endpoint not found");
+    return;
+  }
 
-// Variable to store the HTTP request
-String header;
+  if (!applyShoppingJson(input.as<JsonVariant>(), replica, false)) {
+    sendJsonError(client, "400 Bad Request", "Invalid item, shopping list full or not saved");
+    return;
+  }
+  ShoppingItem* item = findShoppingItem(shopping, input["id"]);
+  beginJsonResponse(json, connection, "200 OK");
+  writeShoppingChangeJson(json, shopping, *item);
+  finishJson(json);
+  Serial.print("API: Shopping item ");
+  Serial.println(item->id);
+}
 
-// Auxiliar variables to store the current output state
-String redLightState = "off";
-String greenLightState = "off";
+// Upstream worker task: one HTTP round trip per notification
+void upstreamWorkerTask(void* parameter) {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    int code = -1;
+    if (WiFi.status() == WL_CONNECTED) {
+      HTTPClient http;
+      http.begin(shoppingUpstreamUrl);
+      http.setConnectTimeout(5000);
+      http.setTimeout(5000);
+      http.addHeader("Content-Type", "application/json");
+      code = http.POST((uint8_t*)upstreamRequest, strlen(upstreamRequest));
+      if (code == 200) {
+        String reply = http.getString();
+        if (reply.length() < upstreamReplyBytes) {
+          memcpy(upstreamReply, reply.c_str(), reply.length() + 1);
+        } else {
+          code = -1;
+        }
+      }
+      http.end();
+    }
+    xQueueSend(upstreamDone, &code, portMAX_DELAY);
+  }
+}
 
-// Assign output variables to GPIO pins
-const int redLight = 18;
-const int greenLight = 19;
-const int lightButton = 21;
-const int timerButton = 22;
+char upstreamHubId[18];
 
-// Light button state variables
-bool lastLightButtonState = HIGH;
-bool currentLightButtonState = HIGH;
-unsigned long lastDebounceTime = 0;
-unsigned long debounceDelay = 50;
+bool startShoppingUpstream() {
+  uint8_t mac[6];
+  WiFi.macAddress(mac);
+  snprintf(upstreamHubId, sizeof(upstreamHubId), "%02X:%02X:%02X:%02X:%02X:%02X",
+           mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  upstreamDone = xQueueCreate(1, sizeof(int));
+  return upstreamDone != NULL &&
+         xTaskCreate(upstreamWorkerTask, "upstream", 8192, NULL, 1, &upstreamWorker) == pdPASS;
+}
 
-// Timer button state variables
-bool lastTimerButtonState = HIGH;
-bool currentTimerButtonState = HIGH;
-unsigned long lastTimerDebounceTime = 0;
-unsigned long timerDebounceDelay = 50;
+// Hands the worker a batch of local changes every upstreamInterval and
+// merges the upstream's reply once the worker is done
+void serviceShoppingUpstream(uint64_t sliceEnd) {
+  if (upstreamInFlight) {
+    int code;
+    if (xQueueReceive(upstreamDone, &code, 0) != pdTRUE) {
+      return;
+    }
+    upstreamInFlight = false;
+    if (code != 200) {
+      upstreamFailures++;
+      return;
+    }
+    markUpstreamSent(shopping, upstreamPendingThrough);
+    upstreamBatches++;
+    JsonDocument& reply = largeResponse();
+    if (!deserializeJson(reply, upstreamReply)) {
+      for (JsonVariant change : reply["changes"].as<JsonArray>()) {
+        applyShoppingJson(change, "upstream", true);
+      }
+    }
+    return;
+  }
 
-// Timer state variable
-String timerState = "stopped"; // "stopped", "running", "paused"
+  uint64_t now = monotonicMicros();
+  if (now < nextUpstreamSync) {
+    return;
+  }
+  nextUpstreamSync = now + upstreamInterval;
+
+  const ShoppingItem* pending[upstreamBatchSize];
+  int count = collectUpstreamChanges(shopping, pending, upstreamBatchSize, upstreamPendingThrough);
+  StaticJsonDocument<JSON_OBJECT_SIZE(2) + JSON_ARRAY_SIZE(upstreamBatchSize) +
+                     upstreamBatchSize * JSON_OBJECT_SIZE(6)> batch;
+  batch["hub"] = (const char*)upstreamHubId;
+  JsonArray changes = batch.createNestedArray("changes");
+  for (int i = 0; i < count; i++) {
+    addShoppingItemJson(changes, *pending[i]);
+  }
+  // Always contact the upstream, even with nothing to push, to pick up its changes
+  serializeJson(batch, upstreamRequest, upstreamRequestBytes);
+  upstreamInFlight = true;
+  xTaskNotifyGive(upstreamWorker);
+}
 
-// Current time
-unsigned long currentTime = millis();
-// Previous time
-unsigned long previousTime = 0;
-// Define timeout time in milliseconds
-const long timeoutTime = 2000;
+void sendReplicationUdp(void* context, uint32_t destination, const uint8_t* data, size_t length) {
+  replicationUdp.beginPacket(destination == 0 ? WiFi.broadcastIP() : IPAddress(destination), replicationPort);
+  replicationUdp.write(data, length);
+  replicationUdp.endPacket();
+}
 
-// Network configuration - adjust for your network
-IPAddress local_IP(192, 168, 1, 100);      // Change to your desired IP
-IPAddress gateway(192, 168, 1, 1);         // Change to your router IP
-IPAddress subnet(255, 255, 255, 0);
+bool startReplication() {
+  uint8_t mac[6];
+  WiFi.macAddress(mac);
+
+  // Versions must keep growing across reboots or peers would ignore us. If
+  // the count is lost, peers still hold our last version and we adopt it.
+  Preferences preferences;
+  preferences.begin("hub", false);
+  uint32_t boots = preferences.getUInt("boots", 0) + 1;
+  preferences.putUInt("boots", boots);
+  preferences.end();
+
+  uint32_t origin = ((uint32_t)mac[2] << 24) | (mac[3] << 16) | (mac[4] << 8) | mac[5];
+  initReplication(replication, origin, hubName, ((boots & 0xFFF) << 20) | 1, (uint32_t)WiFi.localIP(),
+                  monotonicMicros(), sendReplicationUdp, NULL);
+  captureLocalHubState(replication.hubs[0]);
+
+  if (MDNS.begin(hubName)) {
+    MDNS.addService("http", "tcp", 80);
+    MDNS.addService("kitchenhub", "udp", replicationPort);
+  }
+  return replicationUdp.begin(replicationPort) == 1;
+}
 
-void setup() {
- if (!WiFi.config(local_IP, gateway, subnet)) {
-  Serial.println("Static IP configuration failed");
+// Fills the replicated fields from this hub's live state; true if any changed
+bool captureLocalHubState(HubState& self) {
+  uint8_t lights = (redLightState == "on" ? 1 : 0) | (greenLightState == "on" ? 2 : 0);
+  uint8_t timer = timerState == "running" ? 1 : (timerState == "paused" ? 2 : 0);
+  uint16_t duration = timerDuration / 1000000;
+  bool changed = lights != self.lights || timer != self.timer || duration != self.durationSeconds;
+  self.lights = lights;
+  self.timer = timer;
+  self.durationSeconds = duration;
+  self.remainingSeconds = timerRemainingSeconds();
+  return changed;
 }
 
-  Serial.begin(115200);
+void serviceReplication(uint64_t sliceEnd) {
+  uint64_t now = monotonicMicros();
 
-  // Initialize the output variables as outputs
-  pinMode(redLight, OUTPUT);
-  pinMode(greenLight, OUTPUT);
+  while (monotonicMicros() < sliceEnd) {
+    int size = replicationUdp.parsePacket();
+    if (size <= 0) {
+      break;
+    }
+    int length = replicationUdp.read(replicationPacket, maxReplicationPacket);
+    if (length > 0) {
+      handleReplicationPacket(replication, replicationPacket, length, (uint32_t)replicationUdp.remoteIP(), now);
+    }
+  }
 
-  // Initialize light button as input with internal pull-up resistor
-  pinMode(lightButton, INPUT_PULLUP);
+  // Push our own changes right away instead of waiting for the next digest
+  if (captureLocalHubState(replication.hubs[0])) {
+    publishLocalChange(replication, now);
+  }
+  replication.hubs[0].address = (uint32_t)WiFi.localIP();
+  serviceReplicationTimers(replication, now);
+
+  // Start the next boot above a version adopted from a peer
+  if (replication.versionsAdopted != versionsAdoptedSaved) {
+    versionsAdoptedSaved = replication.versionsAdopted;
+    Preferences preferences;
+    preferences.begin("hub", false);
+    preferences.putUInt("boots", replication.hubs[0].version >> 20);
+    preferences.end();
+  }
+}
 
-  // Initialize timer button as input with internal pull-up resistor
-  pinMode(timerButton, INPUT_PULLUP);
+void checkPendingFirmware() {
+  esp_ota_img_states_t state;
+  if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK &&
+      state == ESP_OTA_IMG_PENDING_VERIFY) {
+    otaPendingVerify = true;
+    Serial.println("Running new firmware, boot check pending");
+  }
+}
 
-  // Set outputs to LOW
-  digitalWrite(redLight, LOW);
-  digitalWrite(greenLight, LOW);
+// Flash, hash and socket behind the interfaces in ota_update.h
+class EspOtaTarget : public OtaTarget {
+ public:
+  uint32_t capacity() override {
+    partition = esp_ota_get_next_update_partition(NULL);
+    return partition != NULL ? partition->size : 0;
+  }
+  const char* begin(uint32_t imageBytes) override {
+    // Sequential writes erase each sector just before it is written instead
+    // of the whole partition up front, which would stall for seconds
+    return errorName(esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &handle));
+  }
+  const char* write(const uint8_t* data, size_t length) override {
+    return errorName(esp_ota_write(handle, data, length));
+  }
+  const char* finish() override {
+    // esp_ota_end validates the image header and checksum
+    esp_err_t err = esp_ota_end(handle);
+    if (err == ESP_OK) {
+      err = esp_ota_set_boot_partition(partition);
+    }
+    return errorName(err);
+  }
+  void abort() override {
+    esp_ota_abort(handle);
+  }
 
-  // Connect to Wi-Fi network with SSID and password
-  Serial.print("Connecting to ");
-  Serial.println(ssid);
-  WiFi.begin(ssid, password);
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
-    Serial.print(".");
+ private:
+  static const char* errorName(esp_err_t err) {
+    return err == ESP_OK ? NULL : esp_err_to_name(err);
+  }
+  const esp_partition_t* partition = NULL;
+  esp_ota_handle_t handle = 0;
+};
+
+class MbedtlsOtaHash : public OtaHash {
+ public:
+  void start() override {
+    mbedtls_sha256_init(&context);
+    mbedtls_sha256_starts(&context, 0);
+  }
+  void update(const uint8_t* data, size_t length) override {
+    mbedtls_sha256_update(&context, data, length);
+  }
+  void finish(uint8_t digest[32]) override {
+    mbedtls_sha256_finish(&context, digest);
+    mbedtls_sha256_free(&context);
   }
 
-  // Print local IP address and start web server
-  Serial.println("");
-  Serial.println("WiFi connected.");
-  Serial.println("IP address: ");
-  Serial.println(WiFi.localIP());
-  Serial.println("\nAPI Endpoints:");
-  Serial.println("GET  /api/lights - Get all light states");
-  Serial.println("POST /api/lights/red/on - Turn red light ON");
-  Serial.println("POST /api/lights/red/off - Turn red light OFF");
-  Serial.println("POST /api/lights/green/on - Turn green light ON");
-  Serial.println("POST /api/lights/green/off - Turn green light OFF");
+ private:
+  mbedtls_sha256_context context;
+};
 
-  server.begin();
+class OtaClientSource : public OtaSource {
+ public:
+  int available() override {
+    return otaClient.available();
+  }
+  int read(uint8_t* data, size_t length) override {
+    return otaClient.read(data, length);
+  }
+  bool connected() override {
+    return otaClient.connected();
+  }
+};
+
+EspOtaTarget otaTarget;
+MbedtlsOtaHash otaHash;
+OtaClientSource otaSource;
+
+// Like sendJson, but without the CORS headers: firmware uploads are not
+// offered to pages from other origins
+void sendOtaJson(WiFiClient& client, const char* status, JsonDocument& doc) {
+  beginHttpResponse(httpResponse, status, "application/json", NULL);
+  appendResponse("\r\n");
+  ResponseWriter writer(client);
+  serializeJson(doc, writer);
+  sendResponse(client);
 }
 
-void loop(){
+void startOtaUpload(WiFiClient& client, const char* request, int length) {
+  if (!beginOtaUpload(otaUpload, &otaTarget, &otaHash, request, length, otaToken, monotonicMicros())) {
+    StaticJsonDocument<150> doc;
+    doc["status"] = "error";
+    doc["message"] = otaUpload.message;
+    sendOtaJson(client, otaUpload.status, doc);
+    client.stop();
+    Serial.print("OTA: Refused, ");
+    Serial.println(otaUpload.message);
+    return;
+  }
 
-  handleLightButton();
+  otaClient = client;
+  // Stalls are measured over every task while the upload runs
+  schedulerMaxRun = 0;
+  Serial.print("OTA: Receiving ");
+  Serial.print(length);
+  Serial.println(" bytes");
+}
 
-  handleTimerButton();
+void finishOta() {
+  otaMaxStall = schedulerMaxRun;
+  uint64_t elapsed = monotonicMicros() - otaUpload.startTime;
+  double kbPerSecond = elapsed > 0 ? (otaUpload.receivedBytes / 1024.0) / (elapsed / 1000000.0) : 0.0;
+  StaticJsonDocument<384> doc;
+  doc["status"] = strcmp(otaUpload.status, "200 OK") == 0 ? "success" : "error";
+  doc["message"] = otaUpload.message;
+  doc["bytes"] = otaUpload.receivedBytes;
+  doc["seconds"] = elapsed / 1000000.0;
+  doc["kbPerSecond"] = kbPerSecond;
+  doc["maxStallUs"] = otaMaxStall;
+  sendOtaJson(otaClient, otaUpload.status, doc);
+  otaClient.stop();
+
+  Serial.print("OTA: ");
+  Serial.print(otaUpload.message);
+  Serial.print(", ");
+  Serial.print(kbPerSecond);
+  Serial.print(" KB/s, max stall ");
+  Serial.print((unsigned long)otaMaxStall);
+  Serial.println(" us");
+
+  if (strcmp(otaUpload.status, "200 OK") == 0) {
+    // Give the response time to leave before restarting
+    otaRestartAt = monotonicMicros() + 1000000;
+  }
+}
 
-  // Handle WiFi client requests
-  WiFiClient client = server.available();
+void serviceOta(uint64_t sliceEnd) {
+  if (otaRestartAt != 0 && monotonicMicros() >= otaRestartAt) {
+    esp_restart();
+  }
+  if (otaUpload.active && !serviceOtaUpload(otaUpload, otaSource, sliceEnd, monotonicMicros)) {
+    finishOta();
+  }
+}
 
-  if (client) {
-    currentTime = millis();
-    previousTime = currentTime;
-    Serial.println("New API Client.");
-    String currentLine = "";
-    String requestBody = "";
-    bool isPostRequest = false;
-    int contentLength = 0;
-
-    while (client.connected() && currentTime - previousTime <= timeoutTime) {
-      currentTime = millis();
-      if (client.available()) {
-        char c = client.read();
-        header += c;
-
-        if (c == '\n') {
-          if (currentLine.length() == 0) {
-            // End of headers, handle the request
-            handleAPIRequest(client, header, requestBody);
-            break;
-          } else {
-            // Check for POST request and Content-Length
-            if (currentLine.startsWith("POST")) {
-              isPostRequest = true;
-            }
-            if (currentLine.startsWith("Content-Length: ")) {
-              contentLength = currentLine.substring(16).toInt();
-            }
-            currentLine = "";
-          }
-        } else if (c != '\r') {
-          currentLine += c;
-        }
-      }
+void loadStaticManifest() {
+  if (!LittleFS.begin(true)) {
+    Serial.println("LittleFS mount failed, dashboard disabled");
+    return;
+  }
+  File manifest = LittleFS.open("/manifest.txt", "r");
+  if (!manifest) {
+    Serial.println("No dashboard on LittleFS (run npm run build:dashboard and upload data/)");
+    return;
+  }
+  char line[160];
+  while (manifest.available() > 0 && staticAssetCount < maxStaticAssets) {
+    size_t length = manifest.readBytesUntil('\n', line, sizeof(line) - 1);
+    line[length] = 0;
+    StaticAsset& asset = staticAssets[staticAssetCount];
+    unsigned long maxAge = 0;
+    if (sscanf(line, "%39s %43s %19s %27s %lu", asset.path, asset.file, asset.etag, asset.type, &maxAge) == 5) {
+      asset.maxAge = maxAge;
+      staticAssetCount++;
     }
+  }
+  manifest.close();
+  Serial.print("Dashboard assets: ");
+  Serial.println(staticAssetCount);
+}
 
-    // Clear the header variable
-    header = "";
-    // Close the connection
-    client.stop();
-    Serial.println("API Client disconnected.\n");
+void appendStaticCacheHeaders(const StaticAsset* asset) {
+  appendResponse("ETag: %s\r\n", asset->etag);
+  // Hashed assets never change under the same name; index.html is revalidated every time
+  if (asset->maxAge > 0) {
+    appendResponse("Cache-Control: public, max-age=%lu, immutable\r\n", (unsigned long)asset->maxAge);
+  } else {
+    appendResponse("Cache-Control: no-cache\r\n");
   }
 }
 
-void handleTimerButton() {
-  bool reading = digitalRead(timerButton);
+// The dashboard is stored gzipped only. A request without Accept-Encoding
+// takes any coding; one that lists codings must include gzip (or *) with
+// a non-zero q.
+bool acceptsGzip(const char* request) {
+  const char* header = strstr(request, "Accept-Encoding: ");
+  if (header == NULL) {
+    return true;
+  }
+  header += 17;
+  const char* end = header + strcspn(header, "\r\n");
+  for (const char* coding = header; coding < end; coding += strcspn(coding, ",\r\n")) {
+    coding += strspn(coding, ", ");
+    size_t length = strcspn(coding, " ;,\r\n");
+    if (!(length == 4 && strncmp(coding, "gzip", 4) == 0) && !(length == 1 && coding[0] == '*')) {
+      continue;
+    }
+    const char* params = coding + length;
+    params += strspn(params, " ");
+    if (*params != ';') {
+      return true;
+    }
+    params += 1 + strspn(params + 1, " ");
+    if (strncmp(params, "q=", 2) != 0 || strtod(params + 2, NULL) > 0) {
+      return true;
+    }
+  }
+  return false;
+}
 
-  if (reading != lastTimerButtonState) {
-    lastTimerDebounceTime = millis();
+// Serves a dashboard file for a GET outside /api/. Returns false if there
+// is no such asset.
+bool serveStaticAsset(WiFiClient& client, const char* request) {
+  size_t pathLength = strcspn(request + 4, " ?\r\n");
+  char path[sizeof(StaticAsset::path)];
+  if (pathLength >= sizeof(path)) {
+    return false;
+  }
+  memcpy(path, request + 4, pathLength);
+  path[pathLength] = 0;
+  if (strcmp(path, "/") == 0) {
+    strlcpy(path, "/index.html", sizeof(path));
   }
 
-  if ((millis() - lastTimerDebounceTime) > timerDebounceDelay) {
-    if (reading != currentTimerButtonState) {
-      currentTimerButtonState = reading;
+  StaticAsset* asset = NULL;
+  for (int i = 0; i < staticAssetCount; i++) {
+    if (strcmp(path, staticAssets[i].path) == 0) {
+      asset = &staticAssets[i];
+      break;
+    }
+  }
+  if (asset == NULL) {
+    return false;
+  }
 
-      // Only toggle on button press (LOW, because of pull-up resistor)
-      if (currentTimerButtonState == LOW) {
-        toggleTimer();
-      }
+  if (!acceptsGzip(request)) {
+    beginResponse("406 Not Acceptable", "text/plain");
+    appendResponse("Vary: Accept-Encoding\r\n\r\nThe dashboard is only available gzip-encoded\n");
+    sendResponse(client);
+    return true;
+  }
+
+  const char* ifNoneMatch = strstr(request, "If-None-Match: ");
+  if (ifNoneMatch != NULL) {
+    char tags[96];
+    size_t tagsLength = min(strcspn(ifNoneMatch + 15, "\r\n"), sizeof(tags) - 1);
+    memcpy(tags, ifNoneMatch + 15, tagsLength);
+    tags[tagsLength] = 0;
+    if (strstr(tags, asset->etag) != NULL || strcmp(tags, "*") == 0) {
+      beginResponse("304 Not Modified", NULL);
+      appendStaticCacheHeaders(asset);
+      appendResponse("\r\n");
+      sendResponse(client);
+      staticNotModified++;
+      return true;
     }
   }
 
-  lastTimerButtonState = reading;
+  // The filesystem allocates a handle for the open file, so this route uses
+  // the heap on every request
+  staticFile = LittleFS.open(asset->file, "r");
+  if (!staticFile) {
+    return false;
+  }
+  beginResponse("200 OK", asset->type);
+  appendResponse("Content-Encoding: gzip\r\nContent-Length: %lu\r\nVary: Accept-Encoding\r\n",
+                 (unsigned long)staticFile.size());
+  appendStaticCacheHeaders(asset);
+  appendResponse("\r\n");
+  sendResponse(client);
+
+  // The body is left to streamStaticFile
+  staticResponses++;
+  Serial.print("Sending dashboard asset ");
+  Serial.println(asset->path);
+  return true;
 }
 
-void toggleTimer() {
-  if (timerState == "stopped") {
-    timerState = "running";
-    Serial.println("Timer Button: Timer STARTED");
-  } else if (timerState == "running") {
-    timerState = "paused";
-    Serial.println("Timer Button: Timer PAUSED");
-  } else if (timerState == "paused") {
-    timerState = "running";
-    Serial.println("Timer Button: Timer RESUMED");
+// Sends the open dashboard file a segment at a time until sliceEnd. Returns
+// true once it is all sent or the client has gone, and closes the file.
+bool streamStaticFile(WiFiClient& client, uint64_t sliceEnd) {
+  while (monotonicMicros() < sliceEnd) {
+    if (staticFile.available() <= 0) {
+      break;
+    }
+    int length = staticFile.read(staticChunk, staticChunkBytes);
+    if (length <= 0 || client.write(staticChunk, length) != (size_t)length) {
+      break;
+    }
+  }
+  if (staticFile.available() > 0 && client.connected() && monotonicMicros() >= sliceEnd) {
+    return false;
   }
+  staticFile.close();
+  return true;
 }
 
-void handleLightButton() {
-  // Read the button state
-  bool reading = digitalRead(lightButton);
+// The "history" partition behind the interface in history.h
+class PartitionHistoryFlash : public HistoryFlash {
+ public:
+  const esp_partition_t* partition = NULL;
 
-  // If the switch changed, due to noise or pressing:
-  if (reading != lastLightButtonState) {
-    // Reset the debouncing timer
-    lastDebounceTime = millis();
+  uint32_t size() override {
+    return partition->size;
   }
+  void read(uint32_t offset, uint8_t* data, size_t length) override {
+    esp_partition_read(partition, offset, data, length);
+  }
+  void write(uint32_t offset, const uint8_t* data, size_t length) override {
+    esp_partition_write(partition, offset, data, length);
+  }
+  void erase(uint32_t offset, size_t length) override {
+    esp_partition_erase_range(partition, offset, length);
+  }
+};
 
-  if ((millis() - lastDebounceTime) > debounceDelay) {
-    // If the button state has changed:
-    if (reading != currentLightButtonState) {
-      currentLightButtonState = reading;
+PartitionHistoryFlash historyFlash;
 
-      // Only toggle on button press (LOW, because of pull-up resistor)
-      if (currentLightButtonState == LOW) {
-        toggleLights();
-      }
-    }
+// Query output straight to the client
+class ClientHistorySink : public HistorySink {
+ public:
+  explicit ClientHistorySink(WiFiClient& client) : client(client) {}
+  void write(const char* data, size_t length) override {
+    client.write((const uint8_t*)data, length);
   }
 
-  // Save the reading for next time
-  lastLightButtonState = reading;
-}
+ private:
+  WiFiClient& client;
+};
 
-void toggleLights() {
-  // If both lights are off, turn on green (clean)
-  if (redLightState == "off" && greenLightState == "off") {
-    digitalWrite(greenLight, HIGH);
-    digitalWrite(redLight, LOW);
-    greenLightState = "on";
-    redLightState = "off";
-    Serial.println("Button: Green light (clean) turned ON");
+void startHistoryLog() {
+  historyFlash.partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "history");
+  if (historyFlash.partition == NULL) {
+    Serial.println("History partition not found, history kept in RAM only");
   }
-  // If green is on, switch to red (dirty)
-  if (greenLightState == "on") {
-    digitalWrite(greenLight, LOW);
-    digitalWrite(redLight, HIGH);
-    greenLightState = "off";
-    redLightState = "on";
-    Serial.println("Button: Red light (dirty) turned ON");
-  }
-  // If red is on, switch to green
-  else if (redLightState == "on") {
-    digitalWrite(redLight, LOW);
-    digitalWrite(greenLight, HIGH);
-    redLightState = "off";
-    greenLightState = "on";
-    Serial.println("Button: Green light (clean) turned ON");
+  startHistory(usageHistory, historyFlash.partition != NULL ? &historyFlash : NULL);
+  Serial.print("History records: ");
+  Serial.println(usageHistory.records);
+}
+
+void recordHistory(uint8_t type, uint32_t value) {
+  time_t now = time(NULL);
+  if (now < minValidTime) {
+    historyDroppedNoClock++;
+    return;
   }
+  appendHistory(usageHistory, type, value, now);
 }
 
-void handleAPIRequest(WiFiClient& client, String& request, String& body) {
-  // Set CORS headers to allow cross-origin requests
-  String response = "HTTP/1.1 ";
-  String contentType = "Content-Type: application/json\r\n";
-  String corsHeaders = "Access-Control-Allow-Origin: *\r\n";
-  corsHeaders += "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n";
-  corsHeaders += "Access-Control-Allow-Headers: Content-Type\r\n";
+// Keeps the next history sector erased, so buttons and handlers that record
+// events never wait on a flash erase
+void serviceHistory(uint64_t sliceEnd) {
+  prepareHistorySector(usageHistory);
+}
 
-  // Handle OPTIONS request for CORS preflight
-  if (request.indexOf("OPTIONS") >= 0) {
-    response += "200 OK\r\n";
-    response += corsHeaders;
-    response += "Content-Length: 0\r\n\r\n";
-    client.print(response);
+void sendHistory(WiFiClient& client, uint32_t from, uint32_t to, bool daily) {
+  beginResponse("200 OK", "application/json");
+  appendResponse("\r\n");
+  sendResponse(client);
+  ClientHistorySink sink(client);
+  writeHistoryJson(usageHistory, from, to, daily, time(NULL), sink);
+}
+
+// Timer routes share one response shape
+void sendTimerState(WiFiClient& client, const char* message) {
+  WiFiClientConnection connection(client);
+  JsonWriter json;
+  beginJsonResponse(json, connection, "200 OK");
+  writeTimerJson(json, message, timerState.c_str(), timerDuration / 1000000, timerRemainingSeconds());
+  finishJson(json);
+}
+
+// Light routes share one response shape
+void sendLightStates(WiFiClient& client, const char* message) {
+  WiFiClientConnection connection(client);
+  JsonWriter json;
+  beginJsonResponse(json, connection, "200 OK");
+  writeLightsJson(json, message, redLightState.c_str(), greenLightState.c_str());
+  finishJson(json);
+}
+
+void handleAPIRequest(WiFiClient& client, const char* request, char* body) {
+  // Firmware uploads are not offered to other origins, so their preflight is
+  // refused without CORS headers
+  if (strncmp(request, "OPTIONS /api/ota", 16) == 0) {
+    beginHttpResponse(httpResponse, "403 Forbidden", NULL, NULL);
+    appendResponse("Content-Length: 0\r\n\r\n");
+    sendResponse(client);
     return;
   }
 
-  // GET /api/timer - Return current state of all lights
-  if (request.indexOf("GET /api/timer") >= 0) {
-    response += "200 OK\r\n";
-    response += contentType;
-    response += corsHeaders;
-    response += "\r\n";
-
-    DynamicJsonDocument doc(200);
-    doc["status"] = "success";
-    doc["timer"] = timerState;
+  // Handle OPTIONS request for CORS preflight
+  if (strstr(request, "OPTIONS")) {
+    beginResponse("200 OK", NULL);
+    appendResponse("Content-Length: 0\r\n\r\n");
+    sendResponse(client);
+    return;
+  }
 
-    String jsonString;
-    serializeJson(doc, jsonString);
-    response += jsonString;
+  // Dashboard files; everything outside /api/ is static
+  if (strncmp(request, "GET /", 5) == 0 && strncmp(request, "GET /api/", 9) != 0 &&
+      serveStaticAsset(client, request)) {
+    return;
+  }
 
-    client.print(response);
+  // GET /api/timer - Return current state of all lights
+  if (strstr(request, "GET /api/timer")) {
+    sendTimerState(client, NULL);
     Serial.println("Sent timer state");
     return;
   }
   // POST /api/timer/start - Start timer
-  if (request.indexOf("POST /api/timer/start") >= 0) {
-    timerState = "running";
-    response += "200 OK\r\n";
-    response += contentType;
-    response += corsHeaders;
-    response += "\r\n";
-
-    DynamicJsonDocument doc(200);
-    doc["status"] = "success";
-    doc["message"] = "Timer started";
-    doc["timer"] = timerState;
-
-    String jsonString;
-    serializeJson(doc, jsonString);
-    response += jsonString;
-
-    client.print(response);
+  if (strstr(request, "POST /api/timer/start")) {
+    setTimerState("running");
+    sendTimerState(client, "Timer started");
     Serial.println("API: Timer started");
     return;
   }
 
   // POST /api/timer/pause - Pause timer
-  if (request.indexOf("POST /api/timer/pause") >= 0) {
-    timerState = "paused";
-    response += "200 OK\r\n";
-    response += contentType;
-    response += corsHeaders;
-    response += "\r\n";
-
-    DynamicJsonDocument doc(200);
-    doc["status"] = "success";
-    doc["message"] = "Timer paused";
-    doc["timer"] = timerState;
-
-    String jsonString;
-    serializeJson(doc, jsonString);
-    response += jsonString;
-
-    client.print(response);
+  if (strstr(request, "POST /api/timer/pause")) {
+    setTimerState("paused");
+    sendTimerState(client, "Timer paused");
     Serial.println("API: Timer paused");
     return;
   }
 
   // POST /api/timer/stop - Stop/reset timer
-  if (request.indexOf("POST /api/timer/stop") >= 0) {
-    timerState = "stopped";
-    response += "200 OK\r\n";
-    response += contentType;
-    response += corsHeaders;
-    response += "\r\n";
-
-    DynamicJsonDocument doc(200);
+  if (strstr(request, "POST /api/timer/stop")) {
+    setTimerState("stopped");
+    sendTimerState(client, "Timer stopped");
+    Serial.println("API: Timer stopped");
+    return;
+  }
+
+  // GET /api/dishwasher - Return dishwasher cycle detection state
+  if (strstr(request, "GET /api/dishwasher")) {
+    StaticJsonDocument<384> doc;
     doc["status"] = "success";
-    doc["message"] = "Timer stopped";
-    doc["timer"] = timerState;
+    doc["cycle"] = dishwasher.running ? "running" : "idle";
+    doc["cycleSeconds"] = runningCycleSeconds(dishwasher);
+    doc["lastCycleSeconds"] = dishwasher.lastCycleSeconds;
+    doc["cyclesCompleted"] = dishwasher.cyclesCompleted;
+    JsonObject sensor = doc.createNestedObject("sensor");
+    sensor["rms"] = dishwasher.lastRms;
+    sensor["bandAmplitude"] = dishwasher.lastBandAmplitude;
+    sensor["droppedSamples"] = droppedSamples;
+    sensor["dmaOverflows"] = adcPoolOverflows;
+
+    sendJson(client, "200 OK", doc);
+    Serial.println("Sent dishwasher state");
+    return;
+  }
 
-    String jsonString;
-    serializeJson(doc, jsonString);
-    response += jsonString;
+  // GET /api/display - Return the OLED framebuffer as a PBM image
+  if (strstr(request, "GET /api/display")) {
+    beginResponse("200 OK", "image/x-portable-bitmap");
+    appendResponse("\r\n");
+    sendResponse(client);
+    dumpFramebuffer(client);
+    Serial.println("Sent display framebuffer");
+    return;
+  }
 
-    client.print(response);
-    Serial.println("API: Timer stopped");
+  // POST /api/alarm/stop - Silence the timer alarm
+  if (strstr(request, "POST /api/alarm/stop")) {
+    stopAlarm();
+    StaticJsonDocument<200> doc;
+    doc["status"] = "success";
+    doc["message"] = "Alarm stopped";
+
+    sendJson(client, "200 OK", doc);
+    Serial.println("API: Alarm stopped");
     return;
   }
 
-  // GET /api/lights - Return current state of all lights
-  if (request.indexOf("GET /api/lights") >= 0) {
-    response += "200 OK\r\n";
-    response += contentType;
-    response += corsHeaders;
-    response += "\r\n";
-
-    // Create JSON response
-    DynamicJsonDocument doc(200);
+  // GET /api/household - Return the replicated state of every hub
+  if (strstr(request, "GET /api/household")) {
+    uint64_t now = monotonicMicros();
+    // Publish a change not yet picked up by the replication task; capturing
+    // it here alone would leave peers on the old version
+    if (captureLocalHubState(replication.hubs[0]) && replicationReady) {
+      publishLocalChange(replication, now);
+    }
+
+    JsonDocument& doc = largeResponse();
     doc["status"] = "success";
-    JsonObject lights = doc.createNestedObject("lights");
-    lights["red light"] = redLightState;
-    lights["green light"] = greenLightState;
+    doc["self"] = replication.hubs[0].origin;
+    JsonArray hubList = doc.createNestedArray("hubs");
+    for (int i = 0; i < replication.hubCount; i++) {
+      const HubState& hub = replication.hubs[i];
+      if (hub.version == 0) {
+        continue; // Heard from, but no state yet
+      }
+      JsonObject entry = hubList.createNestedObject();
+      entry["id"] = hub.origin;
+      entry["name"] = (const char*)hub.name;
+      IPAddress address(hub.address);
+      char ip[16];
+      snprintf(ip, sizeof(ip), "%u.%u.%u.%u", address[0], address[1], address[2], address[3]);
+      entry["ip"] = ip;
+      entry["online"] = isHubOnline(replication, i, now);
+      entry["version"] = hub.version;
+      entry["ageMs"] = (now - hub.changedAt) / 1000;
+      JsonObject lights = entry.createNestedObject("lights");
+      lights["red light"] = hub.lights & 1 ? "on" : "off";
+      lights["green light"] = hub.lights & 2 ? "on" : "off";
+      entry["timer"] = hub.timer == 1 ? "running" : (hub.timer == 2 ? "paused" : "stopped");
+      entry["duration"] = hub.durationSeconds;
+      // Count down from the time of the change when the timer is running
+      uint32_t elapsed = hub.timer == 1 ? (now - hub.changedAt) / 1000000 : 0;
+      entry["remaining"] = hub.remainingSeconds > elapsed ? hub.remainingSeconds - elapsed : 0;
+    }
+    JsonObject replicationStats = doc.createNestedObject("replication");
+    replicationStats["packetsSent"] = replication.packetsSent;
+    replicationStats["packetsReceived"] = replication.packetsReceived;
+    replicationStats["bytesSent"] = replication.bytesSent;
+    replicationStats["bytesReceived"] = replication.bytesReceived;
+    replicationStats["updatesApplied"] = replication.updatesApplied;
+    replicationStats["versionsAdopted"] = replication.versionsAdopted;
+    // Time for a change here to reach every online hub, as seen in their digests
+    replicationStats["lastConvergenceMs"] = replication.lastConvergenceMs;
+    replicationStats["maxConvergenceMs"] = replication.maxConvergenceMs;
+
+    sendJson(client, "200 OK", doc);
+    Serial.println("Sent household state");
+    return;
+  }
+
+  // GET /api/history - Usage history from the rollups
+  if (strstr(request, "GET /api/history")) {
+    uint32_t now = time(NULL);
+    bool daily = strstr(request, "bucket=day") != NULL;
+    uint32_t to = queryParam(request, "to", now);
+    uint32_t from = queryParam(request, "from", to - (daily ? 30 * 86400 : 24 * 3600));
+    sendHistory(client, from, to, daily);
+    Serial.println("Sent history");
+    return;
+  }
 
-    String jsonString;
-    serializeJson(doc, jsonString);
-    response += jsonString;
+  // /api/shopping routes - Shopping list store and sync
+  if (strstr(request, " /api/shopping")) {
+    handleShoppingRequest(client, request, body);
+    return;
+  }
 
-    client.print(response);
+  // GET /api/stats - Return scheduler timing statistics
+  if (strstr(request, "GET /api/stats")) {
+    uint64_t uptime = monotonicMicros() - schedulerStartTime;
+    uint64_t playTime = audioPlayTime + (alarmPlaying ? monotonicMicros() - alarmStartedAt : 0);
+
+    WiFiClientConnection connection(client);
+    JsonWriter json;
+    beginJsonResponse(json, connection, "200 OK");
+    jsonObject(json, NULL);
+    jsonString(json, "status", "success");
+    jsonUint(json, "uptimeMs", uptime / 1000);
+    jsonFloat(json, "idlePercent", uptime > 0 ? (100.0 * idleTime) / uptime : 0.0);
+    jsonUint(json, "displayBytesSent", displayBytesSent);
+    jsonObject(json, "ota");
+    jsonBool(json, "active", otaUpload.active);
+    jsonUint(json, "receivedBytes", otaUpload.receivedBytes);
+    jsonUint(json, "expectedBytes", otaUpload.expectedBytes);
+    jsonUint(json, "maxStallUs", otaUpload.active ? schedulerMaxRun : otaMaxStall);
+    jsonEnd(json);
+    jsonObject(json, "dashboard");
+    jsonUint(json, "assets", staticAssetCount);
+    jsonUint(json, "responses", staticResponses);
+    jsonUint(json, "notModified", staticNotModified);
+    jsonEnd(json);
+    writeHistoryStatsJson(json, usageHistory, historyDroppedNoClock);
+    writeShoppingStatsJson(json, shopping, upstreamBatches, upstreamFailures);
+    jsonObject(json, "audio");
+    jsonBool(json, "playing", alarmPlaying);
+    jsonUint(json, "underruns", audioUnderruns);
+    jsonUint(json, "chunksRead", audioChunksRead);
+    jsonFloat(json, "cpuPercent", playTime > 0 ? (100.0 * audioBusyTime) / playTime : 0.0);
+    jsonEnd(json);
+    jsonObject(json, "heap");
+    jsonBool(json, "hooks", heapHooksEnabled());
+    jsonUint(json, "freeBytes", heapFreeBytes);
+    jsonUint(json, "minFreeBytes", heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+    jsonUint(json, "largestFreeBlock", heapLargestBlock);
+    jsonUint(json, "minLargestFreeBlock", minHeapLargestBlock);
+    jsonUint(json, "fragmentationPercent", heapFragmentation);
+    jsonUint(json, "maxFragmentationPercent", maxHeapFragmentation);
+    jsonUint(json, "allocations", heapAllocations);
+    jsonUint(json, "allocatedBytes", heapAllocatedBytes);
+    jsonUint(json, "frees", heapFrees);
+    jsonUint(json, "connectionAllocations", connectionAllocations);
+    writeRouteStatsJson(json, routeStats, routeCount);
+    jsonEnd(json);
+    jsonArray(json, "tasks");
+    for (int i = 0; i < taskCount; i++) {
+      jsonObject(json, NULL);
+      jsonString(json, "name", tasks[i].name);
+      jsonUint(json, "runs", tasks[i].runs);
+      jsonUint(json, "overruns", tasks[i].overruns);
+      jsonUint(json, "missedDeadlines", tasks[i].missedDeadlines);
+      jsonUint(json, "maxRunUs", tasks[i].maxRunTime);
+      jsonUint(json, "maxLatenessUs", tasks[i].maxLateness);
+      jsonEnd(json);
+    }
+    finishJson(json);
+    Serial.println("Sent scheduler stats");
+    return;
+  }
+
+  // GET /api/lights - Return current state of all lights
+  if (strstr(request, "GET /api/lights")) {
+    sendLightStates(client, NULL);
     Serial.println("Sent light states");
     return;
   }
 
   // POST requests for controlling lights
   bool validRequest = false;
-  String responseMessage = "";
+  const char* responseMessage = "";
 
-  if (request.indexOf("POST /api/lights/red/on") >= 0) {
+  if (strstr(request, "POST /api/lights/red/on")) {
     digitalWrite(redLight, HIGH);
     digitalWrite(greenLight, LOW);  // Ensure only one light is on
     redLightState = "on";
     greenLightState = "off";
     responseMessage = "Red light (GPIO18) turned ON";
+    recordHistory(eventDishesDirty, 0);
     validRequest = true;
     Serial.println("API: Red light (GPIO18) turned ON");
 
-  } else if (request.indexOf("POST /api/lights/red/off") >= 0) {
+  } else if (strstr(request, "POST /api/lights/red/off")) {
     digitalWrite(redLight, LOW);
     redLightState = "off";
     responseMessage = "Red light (GPIO18) OFF";
+    recordHistory(eventLightsOff, 0);
     validRequest = true;
     Serial.println("API: Red light (GPIO18) turned OFF");
 
-  } else if (request.indexOf("POST /api/lights/green/on") >= 0) {
+  } else if (strstr(request, "POST /api/lights/green/on")) {
     digitalWrite(greenLight, HIGH);
     digitalWrite(redLight, LOW);  // Ensure only one light is on
     greenLightState = "on";
     redLightState = "off";
     responseMessage = "Green light (GPIO19) turned ON";
+    recordHistory(eventDishesClean, 0);
     validRequest = true;
     Serial.println("API: Green light (GPIO19) turned ON");
 
-  } else if (request.indexOf("POST /api/lights/green/off") >= 0) {
+  } else if (strstr(request, "POST /api/lights/green/off")) {
     digitalWrite(greenLight, LOW);
     greenLightState = "off";
     responseMessage = "Green light (GPIO19) turned OFF";
+    recordHistory(eventLightsOff, 0);
     validRequest = true;
     Serial.println("API: Green light (GPIO19) turned OFF");
   }
 
   if (validRequest) {
-    response += "200 OK\r\n";
-    response += contentType;
-    response += corsHeaders;
-    response += "\r\n";
-
-    // Create success JSON response
-    DynamicJsonDocument doc(200);
-    doc["status"] = "success";
-    doc["message"] = responseMessage;
-    JsonObject lights = doc.createNestedObject("lights");
-    lights["red light"] = redLightState;
-    lights["green light"] = greenLightState;
-
-    String jsonString;
-    serializeJson(doc, jsonString);
-    response += jsonString;
-
+    sendLightStates(client, responseMessage);
   } else {
     // Invalid endpoint
-    response += "404 Not Found\r\n";
-    response += contentType;
-    response += corsHeaders;
-    response += "\r\n";
-
-    DynamicJsonDocument doc(150);
-    doc["status"] = "error";
-    doc["message"] = "Endpoint not found";
-
-    String jsonString;
-    serializeJson(doc, jsonString);
-    response += jsonString;
+    sendJsonError(client, "404 Not Found", "Endpoint not found");
   }
-
-  client.print(response);
-}
\ No newline at end of file
+}
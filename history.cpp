@@ -0,0 +1,240 @@
+#include "history.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static void putUint32(uint8_t* out, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    out[i] = value >> (8 * i);
+  }
+}
+
+static uint32_t getUint32(const uint8_t* in) {
+  return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+static size_t putVarint(uint8_t* out, uint32_t value) {
+  size_t length = 0;
+  while (value >= 0x80) {
+    out[length++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  out[length++] = value;
+  return length;
+}
+
+static size_t getVarint(const uint8_t* in, size_t available, uint32_t& value) {
+  value = 0;
+  for (size_t i = 0; i < available && i < 5; i++) {
+    value |= (uint32_t)(in[i] & 0x7F) << (7 * i);
+    if ((in[i] & 0x80) == 0) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+// Slot for `period` in a rollup ring, cleared if it still holds an older period
+static HistoryBucket& rollupBucket(HistoryBucket* ring, int size, uint32_t period) {
+  HistoryBucket& bucket = ring[period % size];
+  if (bucket.period != period) {
+    memset(&bucket, 0, sizeof(HistoryBucket));
+    bucket.period = period;
+  }
+  return bucket;
+}
+
+static void addToRollups(History& history, uint8_t type, uint32_t time, uint32_t value) {
+  HistoryBucket* buckets[2] = {
+    &rollupBucket(history.hourly, hourlyBuckets, time / 3600),
+    &rollupBucket(history.daily, dailyBuckets, time / 86400)
+  };
+  for (HistoryBucket* bucket : buckets) {
+    if (bucket->counts[type] < UINT16_MAX) {
+      bucket->counts[type]++;
+    }
+    if (type == eventTimerStop || type == eventTimerFinished) {
+      bucket->timerSeconds += value;
+    } else if (type == eventCycleComplete) {
+      bucket->cycleSeconds += value;
+    }
+  }
+}
+
+static uint32_t sectorAddress(uint32_t sector) {
+  return sector * historySectorBytes;
+}
+
+static uint32_t nextSector(const History& history) {
+  return history.sequence == 0 ? 0 : (history.sector + 1) % history.sectorCount;
+}
+
+// Starts the next sector in the ring (the oldest) with a header
+static void startSector(History& history, uint32_t baseTime) {
+  uint32_t sector = nextSector(history);
+  if (!history.nextErased) {
+    history.flash->erase(sectorAddress(sector), historySectorBytes);
+    history.inlineErases++;
+  }
+  history.nextErased = false;
+
+  uint8_t header[historyHeaderBytes] = {'H', 'S', 1, 0};
+  putUint32(header + 4, ++history.sequence);
+  putUint32(header + 8, baseTime);
+  history.flash->write(sectorAddress(sector), header, sizeof(header));
+  history.sector = sector;
+  history.writeOffset = historyHeaderBytes;
+  history.lastTime = baseTime;
+}
+
+void appendHistory(History& history, uint8_t type, uint32_t value, uint32_t timestamp) {
+  history.records++;
+  if (history.flash == NULL) {
+    addToRollups(history, type, timestamp, value);
+    return;
+  }
+
+  // The clock can step backwards after an NTP correction; deltas cannot, so
+  // such a record is stored at the last time and counted there, as a replay
+  // will count it
+  uint32_t delta = timestamp > history.lastTime ? timestamp - history.lastTime : 0;
+  uint8_t record[historyMaxRecordBytes];
+  record[0] = type;
+  size_t length = 1;
+  length += putVarint(record + length, delta);
+  length += putVarint(record + length, value);
+
+  if (history.sequence == 0 || history.writeOffset + length > historySectorBytes) {
+    startSector(history, timestamp);
+    delta = 0;
+    record[1] = 0; // A fresh sector's base is this record's time
+    length = 2 + putVarint(record + 2, value);
+  }
+  history.flash->write(sectorAddress(history.sector) + history.writeOffset, record, length);
+  history.writeOffset += length;
+  history.lastTime += delta;
+  addToRollups(history, type, history.lastTime, value);
+}
+
+bool prepareHistorySector(History& history) {
+  // With a single sector the next one is the current one
+  if (history.flash == NULL || history.nextErased || history.sectorCount < 2) {
+    return false;
+  }
+  history.flash->erase(sectorAddress(nextSector(history)), historySectorBytes);
+  history.nextErased = true;
+  return true;
+}
+
+// Decodes every record of one sector into the rollups. Returns the offset
+// after the last record, and the last timestamp through lastTime.
+static uint32_t replaySector(History& history, uint32_t sector, uint32_t& lastTime) {
+  uint8_t header[historyHeaderBytes];
+  history.flash->read(sectorAddress(sector), header, sizeof(header));
+  lastTime = getUint32(header + 8);
+
+  uint32_t offset = historyHeaderBytes;
+  uint8_t record[historyMaxRecordBytes];
+  while (offset < historySectorBytes) {
+    size_t available = historySectorBytes - offset < historyMaxRecordBytes ? historySectorBytes - offset
+                                                                           : historyMaxRecordBytes;
+    history.flash->read(sectorAddress(sector) + offset, record, available);
+    // Erased flash reads 0xFF: the end of the sector's records
+    if (record[0] == 0xFF) {
+      break;
+    }
+    uint32_t delta;
+    uint32_t value;
+    size_t deltaLength = getVarint(record + 1, available - 1, delta);
+    size_t valueLength = deltaLength ? getVarint(record + 1 + deltaLength, available - 1 - deltaLength, value) : 0;
+    if (record[0] == 0 || record[0] >= historyEventTypes || valueLength == 0) {
+      // A write cut short by a power loss; those bytes cannot be rewritten,
+      // so report the sector as full and let the next record start a new one
+      return historySectorBytes;
+    }
+    lastTime += delta;
+    addToRollups(history, record[0], lastTime, value);
+    history.records++;
+    offset += 1 + deltaLength + valueLength;
+  }
+  return offset;
+}
+
+void startHistory(History& history, HistoryFlash* flash) {
+  memset(&history, 0, sizeof(history));
+  history.flash = flash;
+  if (flash == NULL) {
+    return;
+  }
+  history.sectorCount = flash->size() / historySectorBytes;
+
+  // Replay sectors oldest first; sequence numbers give the order
+  uint32_t replayed = 0;
+  while (true) {
+    uint32_t next = 0;
+    uint32_t nextSequence = 0;
+    for (uint32_t sector = 0; sector < history.sectorCount; sector++) {
+      uint8_t header[historyHeaderBytes];
+      flash->read(sectorAddress(sector), header, sizeof(header));
+      uint32_t sequence = getUint32(header + 4);
+      if (header[0] == 'H' && header[1] == 'S' && header[2] == 1 && sequence > replayed &&
+          (nextSequence == 0 || sequence < nextSequence)) {
+        next = sector;
+        nextSequence = sequence;
+      }
+    }
+    if (nextSequence == 0) {
+      break;
+    }
+    history.sector = next;
+    history.sequence = nextSequence;
+    history.writeOffset = replaySector(history, next, history.lastTime);
+    replayed = nextSequence;
+  }
+}
+
+void writeHistoryJson(const History& history, uint32_t from, uint32_t to, bool daily, uint32_t now,
+                      HistorySink& sink) {
+  const HistoryBucket* ring = daily ? history.daily : history.hourly;
+  int size = daily ? dailyBuckets : hourlyBuckets;
+  uint32_t bucketSeconds = daily ? 86400 : 3600;
+  uint32_t first = from / bucketSeconds;
+  uint32_t last = to / bucketSeconds;
+  // Only periods still held by the ring can be answered, and nothing is
+  // recorded in the future, which also bounds the loop below
+  uint32_t newest = now / bucketSeconds;
+  if (last > newest) {
+    last = newest;
+  }
+  if (newest >= (uint32_t)size && first <= newest - size) {
+    first = newest - size + 1;
+  }
+
+  char buffer[historyChunkBytes];
+  int length = snprintf(buffer, sizeof(buffer),
+    "{\"status\":\"success\",\"bucket\":\"%s\",\"bucketSeconds\":%lu,"
+    "\"fields\":[\"start\",\"dishwasherRuns\",\"cyclesDetected\",\"cycleSeconds\",\"timersRun\",\"timerSeconds\"],"
+    "\"buckets\":[",
+    daily ? "day" : "hour", (unsigned long)bucketSeconds);
+  bool firstBucket = true;
+  for (uint32_t period = first; period <= last; period++) {
+    const HistoryBucket& bucket = ring[period % size];
+    if (bucket.period != period) {
+      continue; // Nothing recorded in this period
+    }
+    if (length > (int)sizeof(buffer) - 96) {
+      sink.write(buffer, length);
+      length = 0;
+    }
+    uint32_t dishwasherRuns = bucket.counts[eventDishesClean];
+    uint32_t timersRun = bucket.counts[eventTimerStop] + bucket.counts[eventTimerFinished];
+    length += snprintf(buffer + length, sizeof(buffer) - length, "%s[%lu,%lu,%lu,%lu,%lu,%lu]",
+                       firstBucket ? "" : ",", (unsigned long)period * bucketSeconds,
+                       (unsigned long)dishwasherRuns, (unsigned long)bucket.counts[eventCycleComplete],
+                       (unsigned long)bucket.cycleSeconds, (unsigned long)timersRun,
+                       (unsigned long)bucket.timerSeconds);
+    firstBucket = false;
+  }
+  length += snprintf(buffer + length, sizeof(buffer) - length, "]}");
+  sink.write(buffer, length);
+}
@@ -0,0 +1,91 @@
+// Usage history. State changes are appended to the "history" partition as
+// (type, varint seconds since the previous record, varint value). The
+// partition is a ring of 4 KB sectors, each starting with a header holding
+// a sequence number and the base time its deltas count from. The sector
+// after the current one is kept erased ahead of time by
+// prepareHistorySector, so recording an event only ever programs bytes;
+// that costs the ring the oldest sector's worth of records. Hourly and
+// daily rollups are kept in RAM (rebuilt from the ring at boot) so queries
+// never scan raw records.
+//
+// Flash and the query output go through the interfaces below, so a year of
+// events can be recorded, replayed and queried on a host (see
+// test/test_history.cpp).
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+const uint8_t eventDishesClean = 1;
+const uint8_t eventDishesDirty = 2;
+const uint8_t eventLightsOff = 3;
+const uint8_t eventTimerStart = 4;
+const uint8_t eventTimerPause = 5;
+const uint8_t eventTimerResume = 6;
+const uint8_t eventTimerStop = 7;     // Value: seconds the timer ran
+const uint8_t eventTimerFinished = 8; // Value: seconds the timer ran
+const uint8_t eventCycleComplete = 9; // Value: cycle length in seconds
+const int historyEventTypes = 10;
+
+struct HistoryBucket {
+  uint32_t period;  // Hours (or days) since the Unix epoch; tells which period the slot holds
+  uint16_t counts[historyEventTypes];
+  uint32_t timerSeconds;
+  uint32_t cycleSeconds;
+};
+
+const int hourlyBuckets = 168; // One week
+const int dailyBuckets = 400;
+
+const uint32_t historySectorBytes = 4096;
+const uint32_t historyHeaderBytes = 12;
+const uint32_t historyMaxRecordBytes = 11;
+const size_t historyChunkBytes = 1460; // Query output is handed over one TCP segment at a time
+
+// The history partition; offsets are from its start
+class HistoryFlash {
+ public:
+  virtual ~HistoryFlash() {}
+  virtual uint32_t size() = 0;
+  virtual void read(uint32_t offset, uint8_t* data, size_t length) = 0;
+  virtual void write(uint32_t offset, const uint8_t* data, size_t length) = 0;
+  virtual void erase(uint32_t offset, size_t length) = 0;
+};
+
+// Receives query output as it is produced
+class HistorySink {
+ public:
+  virtual ~HistorySink() {}
+  virtual void write(const char* data, size_t length) = 0;
+};
+
+struct History {
+  HistoryBucket hourly[hourlyBuckets];
+  HistoryBucket daily[dailyBuckets];
+  HistoryFlash* flash; // NULL keeps history in RAM only
+  uint32_t sectorCount;
+  uint32_t sector;      // Sector being appended to
+  uint32_t sequence;    // Of that sector; 0 before the first one
+  uint32_t writeOffset; // Within the current sector
+  uint32_t lastTime;    // Timestamp the next delta counts from
+  bool nextErased;      // The sector the next one starts in is blank
+  uint32_t records;
+  uint32_t inlineErases; // Sectors started before prepareHistorySector got to them
+};
+
+// Rebuilds the rollups from the sectors on flash (NULL for RAM only)
+void startHistory(History& history, HistoryFlash* flash);
+// Adds an event at timestamp (Unix seconds) to the rollups and the log
+void appendHistory(History& history, uint8_t type, uint32_t value, uint32_t timestamp);
+// Erases the sector the log moves to next, unless that is done already.
+// Erasing takes tens of milliseconds, so this belongs in a low-priority
+// task rather than wherever events are recorded. Returns true if it erased.
+bool prepareHistorySector(History& history);
+// Writes the buckets of [from, to] as JSON. Each bucket is
+// [start, dishwasherRuns, cyclesDetected, cycleSeconds, timersRun, timerSeconds].
+// Periods outside what the ring holds at time now are left out.
+void writeHistoryJson(const History& history, uint32_t from, uint32_t to, bool daily, uint32_t now,
+                      HistorySink& sink);
+
+#endif
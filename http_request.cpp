@@ -0,0 +1,153 @@
+#include "http_request.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void resetHttpRequest(HttpRequest& request) {
+  request.header[0] = 0;
+  request.headerLength = 0;
+  request.lineStart = 0;
+  request.isPost = false;
+  request.readingBody = false;
+  request.contentLength = 0;
+  request.body[0] = 0;
+  request.bodyLength = 0;
+}
+
+HttpReadState readHttpRequest(HttpRequest& request, HttpConnection& connection, const char* streamedPrefix,
+                              uint64_t sliceEnd, HttpClock clock) {
+  while (clock() < sliceEnd && connection.available() > 0) {
+    if (request.readingBody) {
+      int length = connection.read((uint8_t*)request.body + request.bodyLength,
+                                   request.contentLength - request.bodyLength);
+      if (length > 0) {
+        request.bodyLength += length;
+      }
+      if (request.bodyLength >= request.contentLength) {
+        request.body[request.bodyLength] = 0;
+        return httpRequestReady;
+      }
+      continue;
+    }
+
+    if (request.headerLength == maxHeaderLength) {
+      return httpHeadersTooLarge;
+    }
+    uint8_t c;
+    if (connection.read(&c, 1) != 1) {
+      break;
+    }
+    request.header[request.headerLength++] = c;
+    request.header[request.headerLength] = 0;
+    if (c != '\n') {
+      continue;
+    }
+
+    const char* line = request.header + request.lineStart;
+    int lineLength = request.headerLength - 1 - request.lineStart;
+    if (lineLength > 0 && line[lineLength - 1] == '\r') {
+      lineLength--;
+    }
+    if (lineLength > 0) {
+      // Check for POST request and Content-Length
+      if (strncmp(line, "POST", 4) == 0) {
+        request.isPost = true;
+      }
+      if (strncmp(line, "Content-Length: ", 16) == 0) {
+        request.contentLength = atoi(line + 16);
+      }
+      request.lineStart = request.headerLength;
+      continue;
+    }
+
+    // End of headers
+    if (streamedPrefix != NULL && strncmp(request.header, streamedPrefix, strlen(streamedPrefix)) == 0) {
+      return httpUploadReady;
+    }
+    if (request.isPost && request.contentLength > maxBodyLength) {
+      return httpBodyTooLarge;
+    }
+    // A POST body follows the headers; anything else is handled now
+    if (request.isPost && request.contentLength > 0) {
+      request.readingBody = true;
+      continue;
+    }
+    return httpRequestReady;
+  }
+  return httpReading;
+}
+
+uint32_t queryParam(const char* request, const char* name, uint32_t fallback) {
+  const char* lineEnd = strchr(request, '\n');
+  size_t nameLength = strlen(name);
+  for (const char* at = strchr(request, '?'); at != NULL && (lineEnd == NULL || at < lineEnd);
+       at = strchr(at + 1, '&')) {
+    if (strncmp(at + 1, name, nameLength) == 0 && at[nameLength + 1] == '=') {
+      return strtoul(at + nameLength + 2, NULL, 10);
+    }
+  }
+  return fallback;
+}
+
+void beginHttpResponse(HttpResponse& response, const char* status, const char* contentType, const char* headers) {
+  response.length = 0;
+  appendHttpResponse(response, "HTTP/1.1 %s\r\n%s", status, headers != NULL ? headers : "");
+  if (contentType != NULL) {
+    appendHttpResponse(response, "Content-Type: %s\r\n", contentType);
+  }
+}
+
+void vappendHttpResponse(HttpResponse& response, const char* format, va_list args) {
+  int length = vsnprintf(response.buffer + response.length, responseBufferBytes - response.length, format, args);
+  if (length > 0) {
+    response.length = response.length + length < responseBufferBytes - 1 ? response.length + length
+                                                                         : responseBufferBytes - 1;
+  }
+}
+
+void appendHttpResponse(HttpResponse& response, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  vappendHttpResponse(response, format, args);
+  va_end(args);
+}
+
+void writeHttpResponse(HttpResponse& response, HttpConnection& connection, const uint8_t* data, size_t length) {
+  size_t written = 0;
+  while (written < length) {
+    if (response.length == responseBufferBytes) {
+      sendHttpResponse(response, connection);
+    }
+    size_t room = responseBufferBytes - response.length;
+    size_t part = length - written < room ? length - written : room;
+    memcpy(response.buffer + response.length, data + written, part);
+    response.length += part;
+    written += part;
+  }
+}
+
+void sendHttpResponse(HttpResponse& response, HttpConnection& connection) {
+  if (response.length > 0) {
+    connection.write((const uint8_t*)response.buffer, response.length);
+  }
+  response.length = 0;
+}
+
+RouteStats* findRoute(RouteStats* routes, int count, const char* request) {
+  for (int i = 0; i < count; i++) {
+    if (strncmp(request, routes[i].prefix, strlen(routes[i].prefix)) == 0) {
+      return &routes[i];
+    }
+  }
+  return &routes[count - 1];
+}
+
+void chargeRoute(RouteStats& route, uint32_t allocations, uint32_t allocatedBytes) {
+  route.requests++;
+  route.allocations += allocations;
+  route.allocatedBytes += allocatedBytes;
+  if (allocations > route.maxAllocations) {
+    route.maxAllocations = allocations;
+  }
+}
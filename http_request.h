@@ -0,0 +1,86 @@
+// Request path of the web server: reading a request into fixed buffers over
+// as many network slices as it takes, building responses in one TCP-segment
+// buffer, and charging each request to a route. None of it allocates. The
+// socket is reached through HttpConnection, so the path can be soaked on a
+// host with every malloc counted (see test/test_http_request.cpp).
+#ifndef HTTP_REQUEST_H
+#define HTTP_REQUEST_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Request line and headers that do not fit are refused with 431
+const int maxHeaderLength = 1536;
+// Larger bodies are refused with 413 without being read
+const int maxBodyLength = 4096;
+const int responseBufferBytes = 1460; // One TCP segment
+
+class HttpConnection {
+ public:
+  virtual ~HttpConnection() {}
+  virtual int available() = 0;
+  virtual int read(uint8_t* data, size_t length) = 0;
+  virtual size_t write(const uint8_t* data, size_t length) = 0;
+};
+
+typedef uint64_t (*HttpClock)();
+
+enum HttpReadState {
+  httpReading,         // Waiting on the client or out of time; call again next slice
+  httpRequestReady,    // header and body hold the whole request
+  httpUploadReady,     // Headers of a streamed request; the body is still on the connection
+  httpHeadersTooLarge,
+  httpBodyTooLarge,
+};
+
+struct HttpRequest {
+  char header[maxHeaderLength + 1]; // Request line and headers, NUL-terminated
+  int headerLength;
+  int lineStart;  // Start of the header line being read
+  bool isPost;
+  bool readingBody;
+  int contentLength;
+  char body[maxBodyLength + 1];     // NUL-terminated; empty without a body
+  int bodyLength;
+};
+
+struct HttpResponse {
+  char buffer[responseBufferBytes];
+  int length;
+};
+
+struct RouteStats {
+  const char* prefix;       // Start of the request line; "" matches anything
+  uint32_t requests;
+  uint32_t allocations;     // Made by the handler, over all requests
+  uint32_t allocatedBytes;
+  uint32_t maxAllocations;  // Worst single request
+};
+
+// Readies request for a new connection
+void resetHttpRequest(HttpRequest& request);
+// Reads until the request is complete or sliceEnd passes. A request line
+// starting with streamedPrefix stops at the end of its headers, leaving the
+// body for its handler to stream.
+HttpReadState readHttpRequest(HttpRequest& request, HttpConnection& connection, const char* streamedPrefix,
+                              uint64_t sliceEnd, HttpClock clock);
+// Unsigned query parameter from the request line, or fallback
+uint32_t queryParam(const char* request, const char* name, uint32_t fallback);
+
+// Starts a response: status line, extra headers (may be NULL) and, unless
+// NULL, the content type
+void beginHttpResponse(HttpResponse& response, const char* status, const char* contentType, const char* headers);
+// Appends printf-style text to the response; anything past the buffer is cut
+void appendHttpResponse(HttpResponse& response, const char* format, ...);
+void vappendHttpResponse(HttpResponse& response, const char* format, va_list args);
+// Appends body bytes, sending the buffer each time it fills
+void writeHttpResponse(HttpResponse& response, HttpConnection& connection, const uint8_t* data, size_t length);
+// Sends whatever is buffered
+void sendHttpResponse(HttpResponse& response, HttpConnection& connection);
+
+// Route for the request line; the last route must be the "" catch-all
+RouteStats* findRoute(RouteStats* routes, int count, const char* request);
+void chargeRoute(RouteStats& route, uint32_t allocations, uint32_t allocatedBytes);
+
+#endif
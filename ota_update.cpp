@@ -0,0 +1,174 @@
+#include "ota_update.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+// Copies the value of header `name` (without the line end) into out; false
+// if the request has no such header or it does not fit
+static bool headerValue(const char* headers, const char* name, char* out, size_t size) {
+  size_t nameLength = strlen(name);
+  for (const char* line = strchr(headers, '\n'); line != NULL; line = strchr(line, '\n')) {
+    line++;
+    if (strncasecmp(line, name, nameLength) != 0 || line[nameLength] != ':') {
+      continue;
+    }
+    const char* value = line + nameLength + 1;
+    while (*value == ' ') {
+      value++;
+    }
+    size_t length = strcspn(value, "\r\n");
+    if (length >= size) {
+      return false;
+    }
+    memcpy(out, value, length);
+    out[length] = 0;
+    return true;
+  }
+  return false;
+}
+
+bool otaAuthorized(const char* headers, const char* token) {
+  size_t tokenLength = strlen(token);
+  char offered[65];
+  if (tokenLength == 0 || !headerValue(headers, "X-OTA-Token", offered, sizeof(offered))) {
+    return false;
+  }
+  // Look at every byte whatever the first mismatch, so the response time
+  // does not reveal how much of a guess was right
+  size_t offeredLength = strlen(offered);
+  uint8_t difference = offeredLength != tokenLength;
+  for (size_t i = 0; i < tokenLength; i++) {
+    difference |= (uint8_t)(token[i] ^ offered[i < offeredLength ? i : 0]);
+  }
+  return difference == 0;
+}
+
+static bool refuse(OtaUpload& upload, const char* status, const char* message) {
+  upload.status = status;
+  upload.message = message;
+  return false;
+}
+
+bool beginOtaUpload(OtaUpload& upload, OtaTarget* target, OtaHash* hash, const char* headers,
+                    int length, const char* token, uint64_t now) {
+  if (upload.active) {
+    return refuse(upload, "409 Conflict", "Firmware update already in progress");
+  }
+  // Before anything touches flash
+  if (!otaAuthorized(headers, token)) {
+    return refuse(upload, "401 Unauthorized", "Missing or wrong X-OTA-Token");
+  }
+  if (length <= 0 || (uint32_t)length > target->capacity()) {
+    return refuse(upload, "400 Bad Request", "Missing Content-Length or image too large");
+  }
+  const char* error = target->begin(length);
+  if (error != NULL) {
+    return refuse(upload, "500 Internal Server Error", error);
+  }
+
+  if (!headerValue(headers, "X-SHA256", upload.expectedHash, sizeof(upload.expectedHash))) {
+    upload.expectedHash[0] = 0;
+  }
+  hash->start();
+  upload.target = target;
+  upload.hash = hash;
+  upload.active = true;
+  upload.expectedBytes = length;
+  upload.receivedBytes = 0;
+  upload.chunkFill = 0;
+  upload.startTime = now;
+  upload.lastData = now;
+  upload.status = NULL;
+  upload.message = NULL;
+  return true;
+}
+
+static void endUpload(OtaUpload& upload, const char* status, const char* message) {
+  if (strcmp(status, "200 OK") != 0) {
+    upload.target->abort();
+  }
+  upload.active = false;
+  upload.status = status;
+  upload.message = message;
+}
+
+// Ends an upload that will not complete. The hash is finished anyway, as
+// the hardware SHA engine stays claimed until it is.
+static void failUpload(OtaUpload& upload, const char* status, const char* message) {
+  uint8_t digest[32];
+  upload.hash->finish(digest);
+  endUpload(upload, status, message);
+}
+
+static const char* writeChunk(OtaUpload& upload) {
+  if (upload.chunkFill == 0) {
+    return NULL;
+  }
+  upload.hash->update(upload.chunk, upload.chunkFill);
+  const char* error = upload.target->write(upload.chunk, upload.chunkFill);
+  upload.chunkFill = 0;
+  return error;
+}
+
+static void completeUpload(OtaUpload& upload) {
+  const char* error = writeChunk(upload);
+  uint8_t digest[32];
+  upload.hash->finish(digest);
+  if (error != NULL) {
+    endUpload(upload, "500 Internal Server Error", "Flash write failed");
+    return;
+  }
+
+  char digestHex[65];
+  for (int i = 0; i < 32; i++) {
+    snprintf(digestHex + 2 * i, 3, "%02x", digest[i]);
+  }
+  if (upload.expectedHash[0] != 0 && strncasecmp(digestHex, upload.expectedHash, 64) != 0) {
+    endUpload(upload, "400 Bad Request", "SHA-256 mismatch");
+    return;
+  }
+
+  error = upload.target->finish();
+  if (error != NULL) {
+    endUpload(upload, "400 Bad Request", error);
+    return;
+  }
+  endUpload(upload, "200 OK", "Firmware updated, restarting");
+}
+
+bool serviceOtaUpload(OtaUpload& upload, OtaSource& source, uint64_t sliceEnd, OtaClock clock) {
+  if (!upload.active) {
+    return false;
+  }
+
+  // Socket bytes land straight in the chunk buffer, which goes to flash when full
+  while (clock() < sliceEnd && upload.receivedBytes < upload.expectedBytes) {
+    int available = source.available();
+    if (available <= 0) {
+      break;
+    }
+    size_t wanted = otaChunkBytes - upload.chunkFill;
+    wanted = (size_t)available < wanted ? available : wanted;
+    uint32_t left = upload.expectedBytes - upload.receivedBytes;
+    wanted = left < wanted ? left : wanted;
+    int got = source.read(upload.chunk + upload.chunkFill, wanted);
+    if (got <= 0) {
+      break;
+    }
+    upload.chunkFill += got;
+    upload.receivedBytes += got;
+    upload.lastData = clock();
+    if (upload.chunkFill == otaChunkBytes && writeChunk(upload) != NULL) {
+      failUpload(upload, "500 Internal Server Error", "Flash write failed");
+      return false;
+    }
+  }
+
+  if (upload.receivedBytes == upload.expectedBytes) {
+    completeUpload(upload);
+  } else if (!source.connected() || clock() - upload.lastData > otaIdleTimeout) {
+    failUpload(upload, "408 Request Timeout", "Upload stalled or disconnected");
+  }
+  return upload.active;
+}
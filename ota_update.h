@@ -0,0 +1,77 @@
+// Firmware upload. POST /api/ota streams the image from the socket into the
+// inactive OTA partition one otaChunkBytes buffer at a time, hashing as it
+// goes. The upload must carry the shared secret in X-OTA-Token; an optional
+// X-SHA256 header is checked before the new image is made bootable.
+//
+// Flash, hash, socket and clock are reached through the interfaces below, so
+// uploads can be replayed on a host against a stand-in partition that models
+// flash timing (see test/test_ota_update.cpp).
+#ifndef OTA_UPDATE_H
+#define OTA_UPDATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+const int otaChunkBytes = 4096;
+const uint64_t otaIdleTimeout = 10000000;
+
+// The partition the image is written to. Each call returns NULL on success
+// or a short description of what failed.
+class OtaTarget {
+ public:
+  virtual ~OtaTarget() {}
+  virtual uint32_t capacity() = 0;
+  virtual const char* begin(uint32_t imageBytes) = 0;
+  virtual const char* write(const uint8_t* data, size_t length) = 0;
+  // Validates the image and makes it the one to boot
+  virtual const char* finish() = 0;
+  virtual void abort() = 0;
+};
+
+class OtaHash {
+ public:
+  virtual ~OtaHash() {}
+  virtual void start() = 0;
+  virtual void update(const uint8_t* data, size_t length) = 0;
+  virtual void finish(uint8_t digest[32]) = 0;
+};
+
+class OtaSource {
+ public:
+  virtual ~OtaSource() {}
+  virtual int available() = 0;
+  virtual int read(uint8_t* data, size_t length) = 0;
+  virtual bool connected() = 0;
+};
+
+typedef uint64_t (*OtaClock)();
+
+struct OtaUpload {
+  bool active;
+  OtaTarget* target;
+  OtaHash* hash;
+  char expectedHash[65];
+  uint8_t chunk[otaChunkBytes];
+  size_t chunkFill;
+  uint32_t expectedBytes;
+  uint32_t receivedBytes;
+  uint64_t startTime;
+  uint64_t lastData;
+  // How the last upload (or attempt to start one) ended
+  const char* status;
+  const char* message;
+};
+
+// True if the headers carry X-OTA-Token equal to token, compared in
+// constant time. An empty token refuses every upload.
+bool otaAuthorized(const char* headers, const char* token);
+// Checks the request and starts writing an image of length bytes. On
+// failure nothing has been written and status and message say why.
+bool beginOtaUpload(OtaUpload& upload, OtaTarget* target, OtaHash* hash, const char* headers,
+                    int length, const char* token, uint64_t now);
+// Moves socket bytes to flash until sliceEnd. Returns true while the upload
+// is still running; when it returns false, status and message tell how it
+// ended ("200 OK" once the image is bootable).
+bool serviceOtaUpload(OtaUpload& upload, OtaSource& source, uint64_t sliceEnd, OtaClock clock);
+
+#endif
@@ -0,0 +1,283 @@
+#include "replication.h"
+
+#include <string.h>
+
+static void putUint32(uint8_t* out, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    out[i] = value >> (8 * i);
+  }
+}
+
+static uint32_t getUint32(const uint8_t* in) {
+  return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+void initReplication(Replication& replication, uint32_t origin, const char* name, uint32_t version,
+                     uint32_t address, uint64_t now, ReplicationSend send, void* sendContext) {
+  memset(&replication, 0, sizeof(replication));
+  replication.announceInterval = defaultAnnounceInterval;
+  replication.peerTimeout = defaultPeerTimeout;
+  replication.send = send;
+  replication.sendContext = sendContext;
+  HubState& self = replication.hubs[0];
+  self.origin = origin;
+  strncpy(self.name, name, sizeof(self.name) - 1);
+  self.version = version;
+  self.address = address;
+  self.changedAt = now;
+  replication.hubCount = 1;
+}
+
+HubState* findHub(Replication& replication, uint32_t origin, bool create) {
+  for (int i = 0; i < replication.hubCount; i++) {
+    if (replication.hubs[i].origin == origin) {
+      return &replication.hubs[i];
+    }
+  }
+  if (!create || replication.hubCount >= maxHubs) {
+    return NULL;
+  }
+  HubState* hub = &replication.hubs[replication.hubCount++];
+  memset(hub, 0, sizeof(HubState));
+  hub->origin = origin;
+  return hub;
+}
+
+bool isHubOnline(const Replication& replication, int index, uint64_t now) {
+  const HubState& hub = replication.hubs[index];
+  return index == 0 || (hub.lastHeard > 0 && now - hub.lastHeard < replication.peerTimeout);
+}
+
+// Packet header: "KH", protocol version, type, sender id
+static size_t writeHeader(Replication& replication, uint8_t type) {
+  replication.packet[0] = 'K';
+  replication.packet[1] = 'H';
+  replication.packet[2] = 1;
+  replication.packet[3] = type;
+  putUint32(replication.packet + 4, replication.hubs[0].origin);
+  return 8;
+}
+
+static void sendPacket(Replication& replication, uint32_t destination, size_t length) {
+  replication.send(replication.sendContext, destination, replication.packet, length);
+  replication.packetsSent++;
+  replication.bytesSent += length;
+}
+
+// Announce: our name, then (origin, version) for every hub we know of
+static void broadcastAnnounce(Replication& replication) {
+  size_t length = writeHeader(replication, 1);
+  uint8_t* packet = replication.packet;
+  size_t nameLength = strlen(replication.hubs[0].name);
+  packet[length++] = nameLength;
+  memcpy(packet + length, replication.hubs[0].name, nameLength);
+  length += nameLength;
+  packet[length++] = replication.hubCount;
+  for (int i = 0; i < replication.hubCount; i++) {
+    putUint32(packet + length, replication.hubs[i].origin);
+    putUint32(packet + length + 4, replication.hubs[i].version);
+    length += 8;
+  }
+  sendPacket(replication, 0, length);
+}
+
+// State: full entries for the hubs selected in `include`
+static void sendStateEntries(Replication& replication, uint32_t destination, const bool* include, uint64_t now) {
+  uint8_t* packet = replication.packet;
+  size_t length = writeHeader(replication, 2);
+  size_t countAt = length++;
+  uint8_t count = 0;
+  for (int i = 0; i < replication.hubCount; i++) {
+    const HubState& hub = replication.hubs[i];
+    if (!include[i] || hub.version == 0) {
+      continue;
+    }
+    size_t nameLength = strlen(hub.name);
+    if (length + 25 + nameLength > maxReplicationPacket) {
+      break;
+    }
+    putUint32(packet + length, hub.origin);
+    putUint32(packet + length + 4, hub.version);
+    packet[length + 8] = hub.lights;
+    packet[length + 9] = hub.timer;
+    packet[length + 10] = hub.durationSeconds;
+    packet[length + 11] = hub.durationSeconds >> 8;
+    putUint32(packet + length + 12, hub.remainingSeconds);
+    // Age lets the receiver place the change on its own clock
+    putUint32(packet + length + 16, (now - hub.changedAt) / 1000);
+    putUint32(packet + length + 20, hub.address);
+    packet[length + 24] = nameLength;
+    memcpy(packet + length + 25, hub.name, nameLength);
+    length += 25 + nameLength;
+    count++;
+  }
+  packet[countAt] = count;
+  if (count > 0) {
+    sendPacket(replication, destination, length);
+  }
+}
+
+void publishLocalChange(Replication& replication, uint64_t now) {
+  HubState& self = replication.hubs[0];
+  self.version++;
+  self.changedAt = now;
+  replication.convergingVersion = self.version;
+  replication.convergingSince = now;
+  bool include[maxHubs] = {true};
+  sendStateEntries(replication, 0, include, now);
+}
+
+// A peer holds a newer version of our own entry than we do: our boot count
+// was lost (NVS erased) or wrapped. Peers would ignore everything below
+// their version, so continue from it.
+static void adoptOwnVersion(Replication& replication, uint32_t version, uint64_t now) {
+  replication.hubs[0].version = version;
+  replication.versionsAdopted++;
+  publishLocalChange(replication, now);
+}
+
+// Completes the convergence measurement once every online peer has
+// reported our latest version
+static void checkConvergence(Replication& replication, uint64_t now) {
+  if (replication.convergingVersion == 0) {
+    return;
+  }
+  int peers = 0;
+  for (int i = 1; i < replication.hubCount; i++) {
+    if (!isHubOnline(replication, i, now)) {
+      continue;
+    }
+    if (replication.hubs[i].hasOurVersion < replication.convergingVersion) {
+      return;
+    }
+    peers++;
+  }
+  if (peers == 0) {
+    return;
+  }
+  uint32_t elapsedMs = (now - replication.convergingSince) / 1000;
+  replication.lastConvergenceMs = elapsedMs;
+  if (elapsedMs > replication.maxConvergenceMs) {
+    replication.maxConvergenceMs = elapsedMs;
+  }
+  replication.convergingVersion = 0;
+}
+
+static void handleAnnounce(Replication& replication, HubState* peer, const uint8_t* data, size_t length,
+                           uint32_t senderAddress, uint64_t now) {
+  if (length < 1 || length < 2 + (size_t)data[0]) {
+    return;
+  }
+  size_t offset = 1 + data[0];
+  uint8_t count = data[offset++];
+  if (length < offset + 8 * (size_t)count) {
+    return;
+  }
+  const uint8_t* digest = data + offset;
+
+  uint32_t ownVersion = 0;
+  for (int j = 0; j < count; j++) {
+    if (getUint32(digest + 8 * j) == replication.hubs[0].origin) {
+      ownVersion = getUint32(digest + 8 * j + 4);
+    }
+  }
+  if (peer != NULL) {
+    peer->hasOurVersion = ownVersion;
+  }
+  if (ownVersion > replication.hubs[0].version) {
+    adoptOwnVersion(replication, ownVersion, now);
+  }
+
+  // Send the peer every entry it is missing or holds an older version of
+  bool include[maxHubs] = {};
+  bool any = false;
+  for (int i = 0; i < replication.hubCount; i++) {
+    uint32_t peerVersion = 0;
+    for (int j = 0; j < count; j++) {
+      if (getUint32(digest + 8 * j) == replication.hubs[i].origin) {
+        peerVersion = getUint32(digest + 8 * j + 4);
+      }
+    }
+    if (replication.hubs[i].version > peerVersion) {
+      include[i] = true;
+      any = true;
+    }
+  }
+  if (any) {
+    sendStateEntries(replication, senderAddress, include, now);
+  }
+  checkConvergence(replication, now);
+}
+
+static void handleStateEntries(Replication& replication, const uint8_t* data, size_t length, uint64_t now) {
+  if (length < 1) {
+    return;
+  }
+  uint8_t count = data[0];
+  size_t offset = 1;
+  for (int n = 0; n < count; n++) {
+    if (length < offset + 25 || length < offset + 25 + data[offset + 24]) {
+      return;
+    }
+    const uint8_t* entry = data + offset;
+    size_t nameLength = entry[24] < sizeof(HubState::name) - 1 ? entry[24] : sizeof(HubState::name) - 1;
+    offset += 25 + entry[24];
+
+    uint32_t origin = getUint32(entry);
+    uint32_t version = getUint32(entry + 4);
+    if (origin == replication.hubs[0].origin) {
+      if (version > replication.hubs[0].version) {
+        adoptOwnVersion(replication, version, now);
+      }
+      continue;
+    }
+    HubState* hub = findHub(replication, origin, true);
+    if (hub == NULL || version <= hub->version) {
+      continue;
+    }
+
+    uint64_t ageUs = (uint64_t)getUint32(entry + 16) * 1000;
+    hub->version = version;
+    hub->lights = entry[8];
+    hub->timer = entry[9];
+    hub->durationSeconds = entry[10] | (entry[11] << 8);
+    hub->remainingSeconds = getUint32(entry + 12);
+    hub->address = getUint32(entry + 20);
+    memcpy(hub->name, entry + 25, nameLength);
+    hub->name[nameLength] = 0;
+    hub->changedAt = now - (ageUs < now ? ageUs : now);
+    replication.updatesApplied++;
+  }
+}
+
+void handleReplicationPacket(Replication& replication, const uint8_t* data, size_t length,
+                             uint32_t senderAddress, uint64_t now) {
+  replication.packetsReceived++;
+  replication.bytesReceived += length;
+  if (length < 8 || data[0] != 'K' || data[1] != 'H' || data[2] != 1) {
+    return;
+  }
+  uint32_t sender = getUint32(data + 4);
+  if (sender == replication.hubs[0].origin) {
+    return; // Our own broadcast
+  }
+
+  HubState* peer = findHub(replication, sender, true);
+  if (peer != NULL) {
+    peer->lastHeard = now;
+    peer->address = senderAddress;
+  }
+  if (data[3] == 1) {
+    handleAnnounce(replication, peer, data + 8, length - 8, senderAddress, now);
+  } else if (data[3] == 2) {
+    handleStateEntries(replication, data + 8, length - 8, now);
+  }
+}
+
+void serviceReplicationTimers(Replication& replication, uint64_t now) {
+  if (now - replication.lastAnnounce >= replication.announceInterval) {
+    replication.lastAnnounce = now;
+    broadcastAnnounce(replication);
+  }
+  checkConvergence(replication, now);
+}
@@ -0,0 +1,79 @@
+// Household replication. Each hub is the only writer of its own entry and
+// bumps its version on every change, so applying an update is idempotent:
+// keep it if the version is higher. Hubs broadcast a digest of the versions
+// they hold every announceInterval; a peer that sees it is behind on
+// nothing and ahead on something answers with those entries (anti-entropy),
+// which repairs lost broadcasts.
+//
+// The protocol has no Arduino dependencies: packets go out through a send
+// callback and come in through handleReplicationPacket, so several hubs can
+// run as processes on a host (see test/test_replication.cpp).
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct HubState {
+  uint32_t origin;     // Hub id, low 4 bytes of its MAC
+  char name[16];
+  uint32_t version;    // Boot count in the high 12 bits, change count below
+  uint8_t lights;      // Bit 0 red on, bit 1 green on
+  uint8_t timer;       // 0 stopped, 1 running, 2 paused
+  uint16_t durationSeconds;
+  uint32_t remainingSeconds; // When the version was made
+  uint32_t address;
+  uint64_t changedAt;  // Local clock estimate of when the origin made the version
+  uint64_t lastHeard;  // Last packet from the hub itself; 0 if only relayed
+  uint32_t hasOurVersion; // Our version in this peer's last digest
+};
+
+const int maxHubs = 8;
+const size_t maxReplicationPacket = 512;
+const uint64_t defaultAnnounceInterval = 2000000;
+const uint64_t defaultPeerTimeout = 30000000;
+
+// Sends a packet to a peer's address, or to every hub when destination is 0
+typedef void (*ReplicationSend)(void* context, uint32_t destination, const uint8_t* data, size_t length);
+
+struct Replication {
+  HubState hubs[maxHubs]; // hubs[0] is this hub
+  int hubCount;
+  uint64_t announceInterval;
+  uint64_t peerTimeout;
+  uint64_t lastAnnounce;
+  uint8_t packet[maxReplicationPacket]; // Outgoing only
+  ReplicationSend send;
+  void* sendContext;
+
+  // Measurements
+  uint32_t packetsSent;
+  uint32_t packetsReceived;
+  uint32_t bytesSent;
+  uint32_t bytesReceived;
+  uint32_t updatesApplied;
+  uint32_t versionsAdopted; // Times a peer held a newer version of our own entry
+  // Convergence of our own changes: from the change until the digest of
+  // every online peer shows it. Digests come every announceInterval, so
+  // this overstates the true time by up to one interval.
+  uint32_t convergingVersion; // 0 once converged
+  uint64_t convergingSince;
+  uint32_t lastConvergenceMs;
+  uint32_t maxConvergenceMs;
+};
+
+// hubs[0] is set up from origin, name, address and the first version; the
+// caller fills in the replicated fields before the first announce
+void initReplication(Replication& replication, uint32_t origin, const char* name, uint32_t version,
+                     uint32_t address, uint64_t now, ReplicationSend send, void* sendContext);
+HubState* findHub(Replication& replication, uint32_t origin, bool create);
+bool isHubOnline(const Replication& replication, int index, uint64_t now);
+// Call after changing the replicated fields of hubs[0]: bumps its version
+// and pushes the entry to every hub right away
+void publishLocalChange(Replication& replication, uint64_t now);
+void handleReplicationPacket(Replication& replication, const uint8_t* data, size_t length,
+                             uint32_t senderAddress, uint64_t now);
+// Broadcasts the digest when it is due
+void serviceReplicationTimers(Replication& replication, uint64_t now);
+
+#endif
@@ -0,0 +1,54 @@
+// Builds the hub's web dashboard into data/ for the LittleFS upload.
+//
+// Every asset is gzipped here so the hub can stream it as-is with
+// Content-Encoding: gzip. CSS and JS get a content hash in their name and
+// are cached for a year; index.html keeps its name and is revalidated
+// against its ETag, so a repeat visit costs at most a 304.
+// The hub keeps no gzip-free copies: clients that refuse gzip get a 406.
+//
+// Uploading the filesystem image replaces only the dashboard; the shopping
+// list log lives on its own partition.
+const crypto = require("crypto");
+const fs = require("fs");
+const path = require("path");
+const zlib = require("zlib");
+
+const sourceDir = path.join(__dirname, "..", "dashboard");
+const outputDir = path.join(__dirname, "..", "data");
+const contentTypes = {
+  ".html": "text/html",
+  ".css": "text/css",
+  ".js": "application/javascript",
+};
+const oneYear = 31536000;
+
+const hash = (buffer) =>
+  crypto.createHash("sha256").update(buffer).digest("hex").slice(0, 16);
+
+fs.rmSync(outputDir, { recursive: true, force: true });
+fs.mkdirSync(outputDir);
+
+const manifest = [];
+const writeAsset = (urlPath, fileName, contents, maxAge) => {
+  const gzipped = zlib.gzipSync(contents, { level: 9 });
+  fs.writeFileSync(path.join(outputDir, fileName), gzipped);
+  const type = contentTypes[path.extname(urlPath)];
+  // Strong ETag over the bytes actually sent
+  manifest.push(`${urlPath} /${fileName} "${hash(gzipped)}" ${type} ${maxAge}`);
+};
+
+let html = fs.readFileSync(path.join(sourceDir, "index.html"), "utf8");
+for (const name of fs.readdirSync(sourceDir)) {
+  if (name === "index.html") {
+    continue;
+  }
+  const contents = fs.readFileSync(path.join(sourceDir, name));
+  const extension = path.extname(name);
+  const hashedName = `${path.basename(name, extension)}.${hash(contents).slice(0, 8)}${extension}`;
+  html = html.split(`"${name}"`).join(`"${hashedName}"`);
+  writeAsset(`/${hashedName}`, `${hashedName}.gz`, contents, oneYear);
+}
+writeAsset("/index.html", "index.html.gz", Buffer.from(html), 0);
+
+fs.writeFileSync(path.join(outputDir, "manifest.txt"), manifest.join("\n") + "\n");
+console.log(`Wrote ${manifest.length} assets to ${outputDir}`);
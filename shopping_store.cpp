@@ -0,0 +1,238 @@
+#include "shopping_store.h"
+
+#include <string.h>
+
+uint32_t replicaHash(const char* name) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (; *name; name++) {
+    hash = (hash ^ (uint8_t)*name) * 16777619u;
+  }
+  return hash;
+}
+
+uint8_t crc8(const uint8_t* data, size_t length, uint8_t crc) {
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+// Log record: magic, flags, id length, text length, timestamp (8 bytes LE),
+// replica (4 bytes LE), id, text, CRC-8 of everything before it
+size_t encodeShoppingRecord(const ShoppingItem& item, uint8_t* out) {
+  size_t idLength = strlen(item.id);
+  size_t textLength = strlen(item.text);
+  out[0] = shoppingRecordMagic;
+  out[1] = (item.completed ? 1 : 0) | (item.deleted ? 2 : 0);
+  out[2] = idLength;
+  out[3] = textLength;
+  for (int i = 0; i < 8; i++) {
+    out[4 + i] = item.timestamp >> (8 * i);
+  }
+  for (int i = 0; i < 4; i++) {
+    out[12 + i] = item.replica >> (8 * i);
+  }
+  memcpy(out + 16, item.id, idLength);
+  memcpy(out + 16 + idLength, item.text, textLength);
+  size_t length = 16 + idLength + textLength;
+  out[length] = crc8(out, length, 0);
+  return length + 1;
+}
+
+static void copyText(char* out, const char* text, size_t size) {
+  size_t length = strnlen(text, size - 1);
+  memcpy(out, text, length);
+  out[length] = 0;
+}
+
+void initShoppingStore(ShoppingStore& store, uint32_t epoch, ShoppingLog* log) {
+  memset(&store, 0, sizeof(store));
+  store.epoch = epoch;
+  store.log = log;
+}
+
+ShoppingItem* findShoppingItem(ShoppingStore& store, const char* id) {
+  for (int i = 0; i < store.itemCount; i++) {
+    if (strcmp(store.items[i].id, id) == 0) {
+      return &store.items[i];
+    }
+  }
+  return NULL;
+}
+
+// Makes room for a new item by dropping the oldest tombstone
+static ShoppingItem* allocateShoppingItem(ShoppingStore& store) {
+  if (store.itemCount < maxShoppingItems) {
+    return &store.items[store.itemCount++];
+  }
+  ShoppingItem* oldest = NULL;
+  for (int i = 0; i < store.itemCount; i++) {
+    ShoppingItem& item = store.items[i];
+    if (item.deleted && (oldest == NULL || item.timestamp < oldest->timestamp)) {
+      oldest = &item;
+    }
+  }
+  return oldest;
+}
+
+// Merges and, with persist, logs one version of an item. persist is off
+// while the log itself is being replayed.
+static bool mergeShoppingChange(ShoppingStore& store, const char* id, const char* text, bool completed,
+                                bool deleted, uint64_t timestamp, uint32_t replica, bool fromUpstream,
+                                bool persist) {
+  if (timestamp == 0) {
+    timestamp = store.clock + 1;
+  }
+  // Kept so a change that cannot be logged can be taken back
+  int previousCount = store.itemCount;
+  uint32_t previousSeq = store.seq;
+  uint64_t previousClock = store.clock;
+
+  ShoppingItem* item = findShoppingItem(store, id);
+  bool added = item == NULL;
+  if (!added) {
+    bool newer = timestamp > item->timestamp || (timestamp == item->timestamp && replica > item->replica);
+    if (!newer) {
+      return true;
+    }
+  } else {
+    item = allocateShoppingItem(store);
+    if (item == NULL) {
+      return false;
+    }
+  }
+  ShoppingItem previous = *item;
+  if (added) {
+    memset(item, 0, sizeof(ShoppingItem));
+    copyText(item->id, id, sizeof(item->id));
+  }
+
+  if (text != NULL) {
+    copyText(item->text, text, sizeof(item->text));
+  }
+  item->completed = completed;
+  item->deleted = deleted;
+  item->timestamp = timestamp;
+  item->replica = replica;
+  item->seq = ++store.seq;
+  item->fromUpstream = fromUpstream;
+  if (timestamp > store.clock) {
+    store.clock = timestamp;
+  }
+  if (!persist) {
+    return true;
+  }
+
+  uint8_t record[maxShoppingRecordBytes];
+  size_t length = encodeShoppingRecord(*item, record);
+  if (!store.log->append(record, length)) {
+    *item = previous;
+    store.itemCount = previousCount;
+    store.seq = previousSeq;
+    store.clock = previousClock;
+    store.logFailures++;
+    // The write may have left part of a record behind, which would end the
+    // next replay early; rewriting the log from the table drops it
+    compactShoppingLog(store);
+    return false;
+  }
+  store.logRecords++;
+  if (store.logRecords > 4 * (uint32_t)store.itemCount + 64) {
+    compactShoppingLog(store);
+  }
+  return true;
+}
+
+bool applyShoppingChange(ShoppingStore& store, const char* id, const char* text, bool completed,
+                         bool deleted, uint64_t timestamp, uint32_t replica, bool fromUpstream) {
+  return mergeShoppingChange(store, id, text, completed, deleted, timestamp, replica, fromUpstream, true);
+}
+
+bool compactShoppingLog(ShoppingStore& store) {
+  if (!store.log->beginRewrite()) {
+    return false;
+  }
+  uint8_t record[maxShoppingRecordBytes];
+  bool ok = true;
+  for (int i = 0; i < store.itemCount && ok; i++) {
+    size_t length = encodeShoppingRecord(store.items[i], record);
+    ok = store.log->rewrite(record, length);
+  }
+  if (!store.log->endRewrite(ok) || !ok) {
+    return false;
+  }
+  store.logRecords = store.itemCount;
+  return true;
+}
+
+bool loadShoppingLog(ShoppingStore& store) {
+  uint8_t record[maxShoppingRecordBytes];
+  bool damaged = false;
+  for (;;) {
+    size_t length = store.log->read(record, 16);
+    if (length == 0) {
+      break;
+    }
+    if (length != 16 || record[0] != shoppingRecordMagic || record[2] >= sizeof(ShoppingItem::id) ||
+        record[3] >= sizeof(ShoppingItem::text)) {
+      damaged = true;
+      break;
+    }
+    size_t rest = record[2] + record[3] + 1;
+    if (store.log->read(record + 16, rest) != rest || crc8(record, 16 + rest - 1, 0) != record[16 + rest - 1]) {
+      damaged = true;
+      break;
+    }
+
+    char id[sizeof(ShoppingItem::id)];
+    char text[sizeof(ShoppingItem::text)];
+    memcpy(id, record + 16, record[2]);
+    id[record[2]] = 0;
+    memcpy(text, record + 16 + record[2], record[3]);
+    text[record[3]] = 0;
+    uint64_t timestamp = 0;
+    for (int i = 7; i >= 0; i--) {
+      timestamp = (timestamp << 8) | record[4 + i];
+    }
+    uint32_t replica = record[12] | (record[13] << 8) | (record[14] << 16) | ((uint32_t)record[15] << 24);
+    mergeShoppingChange(store, id, text, record[1] & 1, record[1] & 2, timestamp, replica, false, false);
+    store.logRecords++;
+  }
+
+  if (damaged) {
+    compactShoppingLog(store);
+  }
+  return !damaged;
+}
+
+int collectUpstreamChanges(ShoppingStore& store, const ShoppingItem** changes, int maxChanges,
+                           uint32_t& through) {
+  through = store.upstreamSentSeq;
+  int count = 0;
+  while (count < maxChanges) {
+    // Next change in seq order; the table is small so a scan is fine
+    const ShoppingItem* next = NULL;
+    for (int i = 0; i < store.itemCount; i++) {
+      const ShoppingItem& item = store.items[i];
+      if (item.seq > through && !item.fromUpstream && (next == NULL || item.seq < next->seq)) {
+        next = &item;
+      }
+    }
+    if (next == NULL) {
+      break;
+    }
+    changes[count++] = next;
+    through = next->seq;
+  }
+  return count;
+}
+
+void markUpstreamSent(ShoppingStore& store, uint32_t through) {
+  if (through > store.upstreamSentSeq) {
+    store.upstreamSentSeq = through;
+  }
+}
@@ -0,0 +1,88 @@
+// Shopping list store: the item table with its last-writer-wins merge, the
+// append-only log the table is rebuilt from at boot, and the choice of
+// changes to push upstream. Storage is reached through ShoppingLog and there
+// are no Arduino dependencies, so the store runs on a host against a
+// stand-in upstream (see test/test_shopping_store.cpp).
+//
+// Concurrent edits merge per item on (timestamp, replica), and deletes leave
+// tombstones so a phone that was offline cannot bring an item back.
+#ifndef SHOPPING_STORE_H
+#define SHOPPING_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct ShoppingItem {
+  char id[24];
+  char text[64];
+  bool completed;
+  bool deleted;
+  uint64_t timestamp;  // Writer's clock in ms
+  uint32_t replica;    // Hash of the writer's id, breaks timestamp ties
+  uint32_t seq;        // Local change number, for delta sync
+  bool fromUpstream;   // Latest version came from upstream; no need to push it back
+};
+
+const int maxShoppingItems = 64;
+const uint8_t shoppingRecordMagic = 0xA5;
+const size_t maxShoppingRecordBytes = 16 + sizeof(ShoppingItem::id) + sizeof(ShoppingItem::text) + 1;
+
+// Where the log lives. The firmware keeps it in LittleFS; tests keep it in
+// memory and can make any call fail.
+class ShoppingLog {
+ public:
+  virtual ~ShoppingLog() {}
+  // Reads the log from the start, for replay; returns the bytes read
+  virtual size_t read(uint8_t* data, size_t length) = 0;
+  // Adds a record. Returns true only once the record is durable.
+  virtual bool append(const uint8_t* data, size_t length) = 0;
+  // Records written between beginRewrite and endRewrite(true) replace the
+  // whole log in one step; a power loss leaves either the old or the new log
+  virtual bool beginRewrite() = 0;
+  virtual bool rewrite(const uint8_t* data, size_t length) = 0;
+  virtual bool endRewrite(bool commit) = 0;
+};
+
+struct ShoppingStore {
+  ShoppingItem items[maxShoppingItems];
+  int itemCount;
+  uint32_t seq;
+  // Changes to the table since boot get increasing seq numbers. Phones send
+  // back the epoch with their last seq; a different epoch means the hub
+  // restarted and they need a full copy.
+  uint32_t epoch;
+  uint64_t clock;           // Highest timestamp seen, for changes that arrive without one
+  uint32_t logRecords;
+  uint32_t logFailures;     // Changes refused because they could not be written
+  uint32_t upstreamSentSeq; // Local changes up to here have reached the upstream
+  ShoppingLog* log;
+};
+
+uint32_t replicaHash(const char* name);
+uint8_t crc8(const uint8_t* data, size_t length, uint8_t crc);
+size_t encodeShoppingRecord(const ShoppingItem& item, uint8_t* out);
+
+void initShoppingStore(ShoppingStore& store, uint32_t epoch, ShoppingLog* log);
+// Replays the log into a freshly initialised store. A bad record means a
+// write was cut short by a power loss; everything before it is kept, the log
+// is rewritten without it and false is returned.
+bool loadShoppingLog(ShoppingStore& store);
+// Rewrites the log with one record per item, dropping superseded versions
+bool compactShoppingLog(ShoppingStore& store);
+
+ShoppingItem* findShoppingItem(ShoppingStore& store, const char* id);
+// Merges one version of an item and logs it. Losing to a newer version (or
+// replaying a known one) is not an error; a full table or a failed log write
+// is, and leaves the table as it was so the sender can retry.
+// text == NULL keeps the current text.
+bool applyShoppingChange(ShoppingStore& store, const char* id, const char* text, bool completed,
+                         bool deleted, uint64_t timestamp, uint32_t replica, bool fromUpstream);
+
+// Collects, in seq order, up to maxChanges local changes the upstream has not
+// had yet. through is set to the seq to pass to markUpstreamSent once the
+// upstream has accepted them.
+int collectUpstreamChanges(ShoppingStore& store, const ShoppingItem** changes, int maxChanges,
+                           uint32_t& through);
+void markUpstreamSent(ShoppingStore& store, uint32_t through);
+
+#endif
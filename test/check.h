@@ -0,0 +1,51 @@
+// Minimal checks for the host tests. A failed check is reported and counted;
+// each test's main() returns checkFailures() so ctest sees the result.
+#ifndef TEST_CHECK_H
+#define TEST_CHECK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+inline int& checkFailureCount() {
+  static int failures = 0;
+  return failures;
+}
+
+#define CHECK(cond)                                                      \
+  do {                                                                   \
+    if (!(cond)) {                                                       \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      checkFailureCount()++;                                             \
+    }                                                                    \
+  } while (0)
+
+#define CHECK_EQ(actual, expected)                                       \
+  do {                                                                   \
+    long long actualValue = (long long)(actual);                         \
+    long long expectedValue = (long long)(expected);                     \
+    if (actualValue != expectedValue) {                                  \
+      fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, \
+              actualValue, expectedValue);                               \
+      checkFailureCount()++;                                             \
+    }                                                                    \
+  } while (0)
+
+#define CHECK_NEAR(actual, expected, tolerance)                          \
+  do {                                                                   \
+    double actualValue = (double)(actual);                               \
+    double expectedValue = (double)(expected);                           \
+    if (actualValue < expectedValue - (tolerance) || actualValue > expectedValue + (tolerance)) { \
+      fprintf(stderr, "%s:%d: %s is %g, expected %g +/- %g\n", __FILE__, __LINE__, #actual, \
+              actualValue, expectedValue, (double)(tolerance));          \
+      checkFailureCount()++;                                             \
+    }                                                                    \
+  } while (0)
+
+inline int checkFailures() {
+  if (checkFailureCount() > 0) {
+    fprintf(stderr, "%d check(s) failed\n", checkFailureCount());
+  }
+  return checkFailureCount() > 0 ? 1 : 0;
+}
+
+#endif
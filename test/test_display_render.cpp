@@ -0,0 +1,88 @@
+// Timer screen rendering: known states are rendered and compared, as PBM
+// images, with the ones stored in test/data. Run with UPDATE_GOLDEN=1 to
+// rewrite the stored images after an intended change, then review them
+// (any PBM viewer opens them).
+#include <string.h>
+
+#include <string>
+
+#include "check.h"
+#include "display_render.h"
+
+void appendToString(void* context, const char* data, size_t length) {
+  ((std::string*)context)->append(data, length);
+}
+
+std::string renderPbm(uint32_t remainingSeconds, const char* state, uint32_t presetSeconds) {
+  uint8_t frame[framebufferBytes];
+  memset(frame, 0xA5, sizeof(frame)); // Rendering must clear what was there
+  renderTimerScreen(frame, remainingSeconds, state, presetSeconds);
+  std::string pbm;
+  writePbm(frame, appendToString, &pbm);
+  return pbm;
+}
+
+void checkAgainstGolden(const char* name, const std::string& pbm) {
+  std::string path = std::string(TEST_DATA_DIR) + "/" + name;
+  if (getenv("UPDATE_GOLDEN") != NULL) {
+    FILE* file = fopen(path.c_str(), "wb");
+    CHECK(file != NULL);
+    if (file != NULL) {
+      fwrite(pbm.data(), 1, pbm.size(), file);
+      fclose(file);
+    }
+    return;
+  }
+
+  std::string golden;
+  FILE* file = fopen(path.c_str(), "rb");
+  CHECK(file != NULL);
+  if (file == NULL) {
+    return;
+  }
+  char buffer[4096];
+  size_t length;
+  while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    golden.append(buffer, length);
+  }
+  fclose(file);
+
+  if (pbm != golden) {
+    fprintf(stderr, "%s differs from the rendered screen:\n%s", name, pbm.c_str());
+    checkFailureCount()++;
+  }
+}
+
+void testPixelLayout() {
+  uint8_t frame[framebufferBytes] = {};
+  setDisplayPixel(frame, 3, 10, true);
+  CHECK_EQ(frame[1 * displayWidth + 3], 1 << 2); // Page 1, bit 2
+  CHECK(getDisplayPixel(frame, 3, 10));
+  setDisplayPixel(frame, 3, 10, false);
+  CHECK_EQ(frame[1 * displayWidth + 3], 0);
+  // Off-screen pixels are clipped, not wrapped
+  setDisplayPixel(frame, displayWidth, 0, true);
+  setDisplayPixel(frame, -1, displayHeight, true);
+  for (size_t i = 0; i < framebufferBytes; i++) {
+    CHECK_EQ(frame[i], 0);
+  }
+  // Characters advance 6 px at scale 1
+  CHECK_EQ(drawText(frame, 0, 0, "12:34", 1), 30);
+  CHECK_EQ(drawText(frame, 0, 0, "12:34", 3), 90);
+}
+
+void testPbmFormat() {
+  std::string pbm = renderPbm(0, "stopped", 300);
+  CHECK(pbm.compare(0, 10, "P1\n128 64\n") == 0);
+  CHECK_EQ(pbm.size(), 10 + displayHeight * (displayWidth + 1));
+}
+
+int main() {
+  testPixelLayout();
+  testPbmFormat();
+  checkAgainstGolden("timer_running.pbm", renderPbm(12 * 60 + 34, "running", 15 * 60));
+  checkAgainstGolden("timer_paused.pbm", renderPbm(5 * 60 + 7, "paused", 5 * 60));
+  // Remaining minutes are clamped to two digits
+  checkAgainstGolden("timer_clamped.pbm", renderPbm(120 * 60 + 59, "running", 60 * 60));
+  return checkFailures();
+}
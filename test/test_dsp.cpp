@@ -0,0 +1,160 @@
+// Dishwasher DSP: kernel accuracy and replay of sensor traces through the
+// cycle detector, window by window as the firmware feeds it.
+#include <math.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "dsp.h"
+
+struct TraceResult {
+  int started = 0;
+  int finished = 0;
+  int ignored = 0;
+  double firstStartSeconds = -1;
+  uint32_t lastCycleSeconds = 0;
+};
+
+// Reads a trace (see test/data/*.trace) and replays it through a fresh detector
+TraceResult replayTrace(const char* name) {
+  std::string path = std::string(TEST_DATA_DIR) + "/" + name;
+  FILE* file = fopen(path.c_str(), "r");
+  TraceResult result;
+  if (file == NULL) {
+    fprintf(stderr, "Cannot open %s\n", path.c_str());
+    checkFailureCount()++;
+    return result;
+  }
+
+  std::map<std::string, std::vector<int16_t>> snippets;
+  std::vector<std::pair<std::string, int>> plays;
+  std::vector<int16_t>* current = NULL;
+  char line[512];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    char label[32];
+    int seconds;
+    if (line[0] == '#') {
+      continue;
+    } else if (sscanf(line, "samples %31s", label) == 1) {
+      current = &snippets[label];
+    } else if (sscanf(line, "play %31s %d", label, &seconds) == 2) {
+      plays.push_back({label, seconds});
+    } else if (current != NULL) {
+      char* cursor = line;
+      char* end;
+      for (long value = strtol(cursor, &end, 10); end != cursor; value = strtol(cursor, &end, 10)) {
+        current->push_back((int16_t)value);
+        cursor = end;
+      }
+    }
+  }
+  fclose(file);
+
+  DishwasherDetector detector;
+  resetDishwasherDetector(detector);
+  int16_t window[dspWindowSize];
+  int fill = 0;
+  uint64_t samplesFed = 0;
+  for (const auto& play : plays) {
+    const std::vector<int16_t>& snippet = snippets[play.first];
+    CHECK(!snippet.empty());
+    uint64_t count = (uint64_t)play.second * dspSampleRate;
+    for (uint64_t i = 0; i < count && !snippet.empty(); i++) {
+      window[fill++] = snippet[i % snippet.size()];
+      samplesFed++;
+      if (fill < dspWindowSize) {
+        continue;
+      }
+      fill = 0;
+      switch (processDishwasherWindow(detector, window, dspWindowSize)) {
+        case cycleStarted:
+          if (result.started++ == 0) {
+            result.firstStartSeconds = (double)samplesFed / dspSampleRate;
+          }
+          break;
+        case cycleFinished:
+          result.finished++;
+          result.lastCycleSeconds = detector.lastCycleSeconds;
+          break;
+        case cycleIgnored:
+          result.ignored++;
+          break;
+        case cycleNone:
+          break;
+      }
+    }
+  }
+  CHECK_EQ(detector.cyclesCompleted, result.finished);
+  return result;
+}
+
+void testKernels() {
+  int16_t samples[dspWindowSize];
+  int32_t coeff = goertzelCoefficient(bandFrequency, dspSampleRate, dspWindowSize);
+  int bin = (int)((float)dspWindowSize * bandFrequency / dspSampleRate + 0.5f);
+  double binFrequency = (double)bin * dspSampleRate / dspWindowSize;
+
+  // A tone of amplitude 100 on the filter's bin
+  for (int i = 0; i < dspWindowSize; i++) {
+    samples[i] = (int16_t)lround(100.0 * sin(2 * M_PI * binFrequency * i / dspSampleRate));
+  }
+  CHECK_NEAR(bandAmplitude(samples, dspWindowSize, coeff), 100, 2);
+  CHECK_NEAR(windowRms(samples, dspWindowSize), 70.7, 1.5);
+
+  // Four bins away the filter sees next to nothing
+  for (int i = 0; i < dspWindowSize; i++) {
+    samples[i] = (int16_t)lround(100.0 * sin(2 * M_PI * (bin + 4) * i / dspWindowSize));
+  }
+  CHECK(bandAmplitude(samples, dspWindowSize, coeff) <= 2);
+
+  // DC removal settles on the offset. Each update's shift rounds down, so
+  // the Q8 mean sits up to 1024/256 = 4 counts low; that is well under the
+  // detector's thresholds.
+  int32_t level = 0;
+  for (int round = 0; round < 40; round++) {
+    for (int i = 0; i < dspWindowSize; i++) {
+      samples[i] = 1850 + (i % 2 ? 10 : -10);
+    }
+    removeDcOffset(samples, dspWindowSize, level);
+  }
+  CHECK_NEAR(level >> 8, 1848, 2);
+  CHECK_NEAR(windowRms(samples, dspWindowSize), 10, 1);
+
+  CHECK_EQ(integerSqrt(0), 0);
+  CHECK_EQ(integerSqrt(99), 9);
+  CHECK_EQ(integerSqrt(100), 10);
+  CHECK_EQ(integerSqrt(0xFFFFFFFFFFFFFFFFull), 0xFFFFFFFFu);
+}
+
+void testFullCycle() {
+  // Fill 90 s, wash 1500 s, soak 300 s, rinse 600 s, dry 480 s
+  TraceResult result = replayTrace("dishwasher_cycle.trace");
+  CHECK_EQ(result.started, 1);
+  CHECK_EQ(result.finished, 1);
+  CHECK_EQ(result.ignored, 0);
+  // Detected within a few seconds of the wash starting at 210 s (the fill
+  // alone stays under the start level)
+  CHECK(result.firstStartSeconds >= 210 && result.firstStartSeconds <= 215);
+  // The soak is shorter than the stop time, so wash through rinse is one cycle
+  CHECK_NEAR(result.lastCycleSeconds, 2400, 5);
+}
+
+void testBumps() {
+  // A 1 s bump never starts a cycle; 30 s of activity starts one that is
+  // dropped as too short once it has been quiet for the stop time
+  TraceResult result = replayTrace("dishwasher_bumps.trace");
+  CHECK_EQ(result.started, 1);
+  CHECK_EQ(result.finished, 0);
+  CHECK_EQ(result.ignored, 1);
+  CHECK(result.firstStartSeconds > 120);
+}
+
+int main() {
+  testKernels();
+  testFullCycle();
+  testBumps();
+  return checkFailures();
+}
@@ -0,0 +1,329 @@
+// Usage history: a simulated year of a busy kitchen recorded into a stand-in
+// for the history partition, then queried and replayed as after a reboot.
+// Checks the answers against rollups kept independently here, that
+// recording never waits on a flash erase, and that flash is only
+// programmed where it was erased. Prints record, replay and query timings.
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "history.h"
+
+// NOR flash: erase sets a sector to 0xFF, programming can only clear bits
+class MemoryFlash : public HistoryFlash {
+ public:
+  std::vector<uint8_t> data;
+  uint32_t erases = 0;
+  uint32_t overwrites = 0;  // Programmed bytes that were not erased first
+
+  explicit MemoryFlash(uint32_t bytes) : data(bytes, 0xFF) {}
+  uint32_t size() override {
+    return data.size();
+  }
+  void read(uint32_t offset, uint8_t* out, size_t length) override {
+    memcpy(out, data.data() + offset, length);
+  }
+  void write(uint32_t offset, const uint8_t* bytes, size_t length) override {
+    for (size_t i = 0; i < length; i++) {
+      if (data[offset + i] != 0xFF) {
+        overwrites++;
+      }
+      data[offset + i] &= bytes[i];
+    }
+  }
+  void erase(uint32_t offset, size_t length) override {
+    memset(data.data() + offset, 0xFF, length);
+    erases++;
+  }
+};
+
+class StringSink : public HistorySink {
+ public:
+  std::string text;
+  int writes = 0;
+  void write(const char* data, size_t length) override {
+    text.append(data, length);
+    writes++;
+  }
+};
+
+struct Event {
+  uint32_t time;
+  uint8_t type;
+  uint32_t value;
+};
+
+// Deterministic stand-in for esp_random
+uint32_t randomState = 1;
+uint32_t nextRandom(uint32_t range) {
+  randomState = randomState * 1103515245 + 12345;
+  return (randomState >> 8) % range;
+}
+
+// A busy kitchen: about four timers and one or two dishwasher runs a day,
+// with the lights and timer controls that go with them
+std::vector<Event> simulateYear(uint32_t start) {
+  std::vector<Event> events;
+  for (uint32_t day = 0; day < 365; day++) {
+    uint32_t base = start + day * 86400;
+    std::vector<Event> today;
+    int timers = 2 + nextRandom(5);
+    for (int i = 0; i < timers; i++) {
+      uint32_t t = base + 6 * 3600 + nextRandom(16 * 3600);
+      uint32_t duration = 60 + nextRandom(1800);
+      today.push_back({t, eventTimerStart, 0});
+      if (nextRandom(4) == 0) {
+        today.push_back({t + duration / 2, eventTimerPause, 0});
+        today.push_back({t + duration / 2 + 30, eventTimerResume, 0});
+      }
+      bool stopped = nextRandom(5) == 0;
+      today.push_back({t + duration + 30, stopped ? eventTimerStop : eventTimerFinished, duration});
+    }
+    int runs = 1 + nextRandom(2);
+    for (int i = 0; i < runs; i++) {
+      uint32_t t = base + 8 * 3600 + nextRandom(12 * 3600);
+      uint32_t cycle = 4800 + nextRandom(1800);
+      today.push_back({t, eventDishesDirty, 0});
+      today.push_back({t + cycle, eventCycleComplete, cycle});
+      today.push_back({t + cycle, eventDishesClean, 0});
+      today.push_back({t + cycle + 3600, eventLightsOff, 0});
+    }
+    std::stable_sort(today.begin(), today.end(), [](const Event& a, const Event& b) { return a.time < b.time; });
+    events.insert(events.end(), today.begin(), today.end());
+  }
+  return events;
+}
+
+// What a query should return for one bucket, as printed in the JSON
+struct Expected {
+  unsigned long dishwasherRuns, cycles, cycleSeconds, timersRun, timerSeconds;
+  bool operator==(const Expected& other) const {
+    return dishwasherRuns == other.dishwasherRuns && cycles == other.cycles &&
+           cycleSeconds == other.cycleSeconds && timersRun == other.timersRun &&
+           timerSeconds == other.timerSeconds;
+  }
+};
+
+std::map<unsigned long, Expected> expectedBuckets(const std::vector<Event>& events, uint32_t bucketSeconds,
+                                                  uint32_t from, uint32_t to) {
+  std::map<unsigned long, Expected> buckets;
+  for (const Event& event : events) {
+    if (event.time / bucketSeconds < from / bucketSeconds || event.time / bucketSeconds > to / bucketSeconds) {
+      continue;
+    }
+    Expected& bucket = buckets[event.time / bucketSeconds * bucketSeconds];
+    if (event.type == eventDishesClean) {
+      bucket.dishwasherRuns++;
+    } else if (event.type == eventCycleComplete) {
+      bucket.cycles++;
+      bucket.cycleSeconds += event.value;
+    } else if (event.type == eventTimerStop || event.type == eventTimerFinished) {
+      bucket.timersRun++;
+      bucket.timerSeconds += event.value;
+    }
+  }
+  return buckets;
+}
+
+std::map<unsigned long, Expected> parseBuckets(const std::string& json) {
+  std::map<unsigned long, Expected> buckets;
+  size_t at = json.find("\"buckets\":[");
+  CHECK(at != std::string::npos);
+  CHECK(json.size() >= 2 && json.compare(json.size() - 2, 2, "]}") == 0);
+  if (at == std::string::npos) {
+    return buckets;
+  }
+  const char* p = json.c_str() + at + 11;
+  while (*p == '[' || *p == ',') {
+    p += *p == ',' ? 1 : 0;
+    unsigned long start;
+    Expected bucket;
+    int used = 0;
+    if (sscanf(p, "[%lu,%lu,%lu,%lu,%lu,%lu]%n", &start, &bucket.dishwasherRuns, &bucket.cycles,
+               &bucket.cycleSeconds, &bucket.timersRun, &bucket.timerSeconds, &used) != 6) {
+      break;
+    }
+    buckets[start] = bucket;
+    p += used;
+  }
+  CHECK(strcmp(p, "]}") == 0);
+  return buckets;
+}
+
+// Counts buckets that differ; the query leaves out empty ones
+int mismatches(const std::map<unsigned long, Expected>& expected, const std::map<unsigned long, Expected>& got) {
+  int differences = 0;
+  for (const auto& entry : expected) {
+    auto found = got.find(entry.first);
+    if (found == got.end() || !(found->second == entry.second)) {
+      differences++;
+    }
+  }
+  for (const auto& entry : got) {
+    if (expected.find(entry.first) == expected.end()) {
+      differences++;
+    }
+  }
+  return differences;
+}
+
+double microsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+const uint32_t yearStart = 1735689600;  // 2025-01-01
+const uint32_t partitionBytes = 0x20000;  // From partitions.csv
+
+void testYear() {
+  std::vector<Event> events = simulateYear(yearStart);
+  uint32_t end = events.back().time;
+
+  static History history;
+  MemoryFlash flash(partitionBytes);
+  startHistory(history, &flash);
+
+  // The history task runs every second; running it once per event is the
+  // most it could lag behind
+  auto began = std::chrono::steady_clock::now();
+  uint32_t recordErases = 0;
+  for (const Event& event : events) {
+    prepareHistorySector(history);
+    uint32_t erasesBefore = flash.erases;
+    appendHistory(history, event.type, event.value, event.time);
+    recordErases += flash.erases - erasesBefore;
+  }
+  double recordUs = microsSince(began);
+  CHECK_EQ(recordErases, 0);
+  CHECK_EQ(history.inlineErases, 0);
+  CHECK_EQ(flash.overwrites, 0);
+  CHECK_EQ(history.records, events.size());
+
+  StringSink yearByDay;
+  began = std::chrono::steady_clock::now();
+  writeHistoryJson(history, yearStart, end, true, end, yearByDay);
+  double dailyUs = microsSince(began);
+  CHECK_EQ(mismatches(expectedBuckets(events, 86400, yearStart, end), parseBuckets(yearByDay.text)), 0);
+
+  StringSink weekByHour;
+  began = std::chrono::steady_clock::now();
+  writeHistoryJson(history, end - 7 * 86400, end, false, end, weekByHour);
+  double hourlyUs = microsSince(began);
+  // The ring holds one week of hours, counting the current one
+  uint32_t oldestHour = (end / 3600 - hourlyBuckets + 1) * 3600;
+  CHECK_EQ(mismatches(expectedBuckets(events, 3600, oldestHour, end), parseBuckets(weekByHour.text)), 0);
+
+  // A `to` past the present is answered up to the present, not dropped
+  StringSink future;
+  writeHistoryJson(history, end - 30 * 86400, 0xFFFFFFFF, true, end, future);
+  CHECK_EQ(mismatches(expectedBuckets(events, 86400, end - 30 * 86400, end), parseBuckets(future.text)), 0);
+  CHECK(parseBuckets(future.text).size() > 20);
+
+  // Reboot: the rollups come back from flash alone
+  static History rebooted;
+  began = std::chrono::steady_clock::now();
+  startHistory(rebooted, &flash);
+  double replayUs = microsSince(began);
+  CHECK_EQ(rebooted.records, events.size());
+  StringSink replayed;
+  writeHistoryJson(rebooted, yearStart, end, true, end, replayed);
+  CHECK(replayed.text == yearByDay.text);
+  uint32_t sectorsUsed = rebooted.sequence;
+
+  printf("year: %zu events in %u of %u sectors; record %.2f us/event, replay %.0f us, "
+         "year by day %.0f us (%zu bytes, %d writes), week by hour %.0f us (%zu bytes)\n",
+         events.size(), sectorsUsed, partitionBytes / historySectorBytes, recordUs / events.size(), replayUs,
+         dailyUs, yearByDay.text.size(), yearByDay.writes, hourlyUs, weekByHour.text.size());
+}
+
+void testRingWrap() {
+  std::vector<Event> events = simulateYear(yearStart);
+  uint32_t end = events.back().time;
+
+  // Four sectors hold well under a year, so the ring wraps many times
+  static History history;
+  MemoryFlash flash(4 * historySectorBytes);
+  startHistory(history, &flash);
+  for (const Event& event : events) {
+    prepareHistorySector(history);
+    appendHistory(history, event.type, event.value, event.time);
+  }
+  CHECK_EQ(history.inlineErases, 0);
+  CHECK_EQ(flash.overwrites, 0);
+
+  // After a reboot the ring gives back the newest sectors, minus the one
+  // kept erased for the next write
+  static History rebooted;
+  startHistory(rebooted, &flash);
+  CHECK(rebooted.records > 0);
+  CHECK(rebooted.records < events.size());
+  std::vector<Event> kept(events.end() - rebooted.records, events.end());
+  uint32_t from = kept.front().time / 86400 * 86400 + 86400;  // First whole day kept
+  StringSink got;
+  writeHistoryJson(rebooted, from, end, true, end, got);
+  CHECK_EQ(mismatches(expectedBuckets(kept, 86400, from, end), parseBuckets(got.text)), 0);
+
+  // Recording carries on where it left off without an inline erase
+  appendHistory(rebooted, eventTimerStart, 0, end + 60);
+  prepareHistorySector(rebooted);
+  for (int i = 0; i < 2000; i++) {
+    prepareHistorySector(rebooted);
+    appendHistory(rebooted, eventTimerFinished, 300, end + 120 + i);
+  }
+  CHECK(rebooted.inlineErases <= 1);  // Only the first sector started before the task ran
+  CHECK_EQ(flash.overwrites, 0);
+}
+
+void testWithoutTask() {
+  // If the task never runs, sectors are still erased, just inline
+  static History history;
+  MemoryFlash flash(4 * historySectorBytes);
+  startHistory(history, &flash);
+  for (int i = 0; i < 3000; i++) {
+    appendHistory(history, eventTimerFinished, 300, yearStart + i * 60);
+  }
+  CHECK(history.inlineErases > 1);
+  CHECK_EQ(flash.overwrites, 0);
+}
+
+void testClockStepBack() {
+  static History history;
+  MemoryFlash flash(4 * historySectorBytes);
+  startHistory(history, &flash);
+  uint32_t time = yearStart + 10 * 3600;
+  appendHistory(history, eventTimerFinished, 300, time);
+  // NTP pulls the clock back across midnight, then it runs on from there
+  appendHistory(history, eventTimerFinished, 600, time - 2 * 86400);
+  appendHistory(history, eventCycleComplete, 5400, time - 2 * 86400 + 60);
+  appendHistory(history, eventDishesClean, 0, time + 3600);
+  uint32_t end = time + 3600;
+
+  static History rebooted;
+  startHistory(rebooted, &flash);
+  CHECK_EQ(rebooted.records, history.records);
+  StringSink liveDays, replayedDays, liveHours, replayedHours;
+  writeHistoryJson(history, yearStart - 7 * 86400, end, true, end, liveDays);
+  writeHistoryJson(rebooted, yearStart - 7 * 86400, end, true, end, replayedDays);
+  writeHistoryJson(history, end - 7 * 86400, end, false, end, liveHours);
+  writeHistoryJson(rebooted, end - 7 * 86400, end, false, end, replayedHours);
+  CHECK(liveDays.text == replayedDays.text);
+  CHECK(liveHours.text == replayedHours.text);
+  // Everything lands in the hour before the step, where it was stored
+  std::map<unsigned long, Expected> hours = parseBuckets(liveHours.text);
+  CHECK_EQ(hours.size(), 2);
+  CHECK_EQ(hours[time / 3600 * 3600].timerSeconds, 900);
+  CHECK_EQ(hours[time / 3600 * 3600].cycles, 1);
+}
+
+int main() {
+  testYear();
+  testRingWrap();
+  testWithoutTask();
+  testClockStepBack();
+  return checkFailures();
+}
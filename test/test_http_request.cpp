@@ -0,0 +1,510 @@
+// Request path soak: a million requests, each arriving in pieces over
+// several network slices, are read, routed and answered through
+// http_request. The timer, lights, shopping, history and stats answers are
+// written by the firmware's own builders (api_json, writeHistoryJson) from a
+// live shopping store and a year of history; only the routing and the
+// parsing of request bodies stand in for the firmware's. Every malloc in the
+// process is counted; after a warm-up round, steady-state requests must not
+// allocate, and the heap must end the soak in the state it started in.
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "api_json.h"
+#include "check.h"
+#include "history.h"
+#include "http_request.h"
+#include "shopping_store.h"
+
+// glibc lets a program replace malloc; these count and hand on to the
+// real allocator
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void __libc_free(void* ptr);
+
+bool countingAllocations = false;
+unsigned long allocations = 0;
+unsigned long allocatedBytes = 0;
+
+extern "C" void* malloc(size_t size) {
+  if (countingAllocations) {
+    allocations++;
+    allocatedBytes += size;
+  }
+  return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+  if (countingAllocations) {
+    allocations++;
+    allocatedBytes += count * size;
+  }
+  return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size) {
+  if (countingAllocations) {
+    allocations++;
+    allocatedBytes += size;
+  }
+  return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void* ptr) {
+  __libc_free(ptr);
+}
+
+// Virtual clock; reading and writing advance it
+uint64_t now = 0;
+
+uint64_t clockNow() {
+  return now;
+}
+
+uint32_t randomState = 7;
+uint32_t nextRandom(uint32_t range) {
+  randomState = randomState * 1103515245 + 12345;
+  return (randomState >> 8) % range;
+}
+
+// Client socket: the request arrives in pieces of random size, one piece
+// per network slice, and the response is kept for checking
+class ScriptedConnection : public HttpConnection {
+ public:
+  char input[8192];
+  size_t inputLength = 0;
+  size_t consumed = 0;
+  size_t arrived = 0;
+  char output[32768];  // NUL-terminated
+  size_t outputLength = 0;
+  int writes = 0;
+
+  void open(const char* request, size_t length) {
+    memcpy(input, request, length);
+    inputLength = length;
+    consumed = 0;
+    arrived = 0;
+    outputLength = 0;
+    output[0] = 0;
+    writes = 0;
+  }
+  // A segment lands between slices
+  void deliver() {
+    size_t piece = 1 + nextRandom(1460);
+    arrived = arrived + piece < inputLength ? arrived + piece : inputLength;
+  }
+  int available() override {
+    return arrived - consumed;
+  }
+  int read(uint8_t* data, size_t length) override {
+    size_t part = arrived - consumed < length ? arrived - consumed : length;
+    memcpy(data, input + consumed, part);
+    consumed += part;
+    now += 1 + part / 32;
+    return part;
+  }
+  size_t write(const uint8_t* data, size_t length) override {
+    size_t room = sizeof(output) - 1 - outputLength;
+    size_t part = room < length ? room : length;
+    memcpy(output + outputLength, data, part);
+    outputLength += part;
+    output[outputLength] = 0;
+    writes++;
+    now += 20;
+    return length;
+  }
+};
+
+HttpRequest request;
+HttpResponse response;
+
+RouteStats routes[] = {
+  {"GET /api/timer", 0, 0, 0, 0},        {"GET /api/lights", 0, 0, 0, 0},
+  {"POST /api/lights/", 0, 0, 0, 0},     {"GET /api/shopping", 0, 0, 0, 0},
+  {"POST /api/shopping/", 0, 0, 0, 0},   {"GET /api/history", 0, 0, 0, 0},
+  {"GET /api/stats", 0, 0, 0, 0},        {"OPTIONS ", 0, 0, 0, 0},
+  {"", 0, 0, 0, 0},
+};
+const int routeCount = sizeof(routes) / sizeof(routes[0]);
+
+const char* corsHeaders = "Access-Control-Allow-Origin: *\r\n";
+
+// The shopping log is the store's business, tested in test_shopping_store;
+// here it only has to accept appends
+class AcceptingLog : public ShoppingLog {
+ public:
+  size_t read(uint8_t*, size_t) override {
+    return 0;
+  }
+  bool append(const uint8_t*, size_t) override {
+    return true;
+  }
+  bool beginRewrite() override {
+    return true;
+  }
+  bool rewrite(const uint8_t*, size_t) override {
+    return true;
+  }
+  bool endRewrite(bool) override {
+    return true;
+  }
+};
+
+// Sends history chunks straight to the client, as the firmware's sink does
+class ConnectionHistorySink : public HistorySink {
+ public:
+  explicit ConnectionHistorySink(HttpConnection& connection) : connection(connection) {}
+  void write(const char* data, size_t length) override {
+    connection.write((const uint8_t*)data, length);
+  }
+
+ private:
+  HttpConnection& connection;
+};
+
+AcceptingLog shoppingLog;
+ShoppingStore shopping;
+History usageHistory;
+const uint32_t historyNow = 1767225599;  // End of 2025
+const char* redLightState = "off";
+const char* greenLightState = "off";
+
+void beginJsonResponse(JsonWriter& json, HttpConnection& connection, const char* status) {
+  beginHttpResponse(response, status, "application/json", corsHeaders);
+  appendHttpResponse(response, "\r\n");
+  startJson(json, response, connection);
+}
+
+void sendError(HttpConnection& connection, const char* status, const char* message) {
+  JsonWriter json;
+  beginJsonResponse(json, connection, status);
+  writeErrorJson(json, message);
+  finishJson(json);
+}
+
+// Copies the string value of the first "key" at or after from into out,
+// undoing backslash escapes. Returns where the value ends.
+const char* jsonField(const char* from, const char* key, char* out, size_t size) {
+  char pattern[24];
+  snprintf(pattern, sizeof(pattern), "\"%s\":\"", key);
+  const char* at = strstr(from, pattern);
+  if (at == NULL) {
+    return NULL;
+  }
+  at += strlen(pattern);
+  size_t length = 0;
+  for (; *at != 0 && *at != '"'; at++) {
+    if (*at == '\\' && at[1] != 0) {
+      at++;
+    }
+    if (length + 1 < size) {
+      out[length++] = *at;
+    }
+  }
+  out[length] = 0;
+  return at;
+}
+
+// Stand-in for the firmware's ArduinoJson parse: applies each change in the
+// body, returning how many were refused
+int applyChanges(const char* body) {
+  int rejected = 0;
+  char id[sizeof(ShoppingItem::id)];
+  char text[sizeof(ShoppingItem::text)];
+  for (const char* at = jsonField(body, "id", id, sizeof(id)); at != NULL;
+       at = jsonField(at, "id", id, sizeof(id))) {
+    const char* ts = strstr(at, "\"ts\":");
+    if (jsonField(at, "text", text, sizeof(text)) == NULL || ts == NULL ||
+        !applyShoppingChange(shopping, id, text, false, false, strtoull(ts + 5, NULL, 10), replicaHash("phone"),
+                             false)) {
+      rejected++;
+    }
+  }
+  return rejected;
+}
+
+// The firmware's routes, answered by its builders. Serial logging and
+// hardware are left out.
+void handle(HttpConnection& connection) {
+  const char* header = request.header;
+  JsonWriter json;
+  if (strncmp(header, "GET /api/timer", 14) == 0) {
+    beginJsonResponse(json, connection, "200 OK");
+    writeTimerJson(json, NULL, "running", 600, 431);
+    finishJson(json);
+  } else if (strncmp(header, "GET /api/lights", 15) == 0) {
+    beginJsonResponse(json, connection, "200 OK");
+    writeLightsJson(json, NULL, redLightState, greenLightState);
+    finishJson(json);
+  } else if (strncmp(header, "POST /api/lights/red/on", 23) == 0) {
+    redLightState = "on";
+    greenLightState = "off";
+    appendHistory(usageHistory, eventDishesDirty, 0, historyNow);
+    beginJsonResponse(json, connection, "200 OK");
+    writeLightsJson(json, "Red light (GPIO18) turned ON", redLightState, greenLightState);
+    finishJson(json);
+  } else if (strncmp(header, "GET /api/shopping", 17) == 0) {
+    beginJsonResponse(json, connection, "200 OK");
+    writeShoppingJson(json, shopping, queryParam(header, "epoch", 0), queryParam(header, "since", 0), -1);
+    finishJson(json);
+  } else if (strncmp(header, "POST /api/shopping/sync", 23) == 0) {
+    int rejected = applyChanges(request.body);
+    beginJsonResponse(json, connection, "200 OK");
+    writeShoppingJson(json, shopping, 7, queryParam(header, "since", 0), rejected);
+    finishJson(json);
+  } else if (strncmp(header, "POST /api/shopping/add", 22) == 0) {
+    char id[sizeof(ShoppingItem::id)];
+    if (applyChanges(request.body) != 0 || jsonField(request.body, "id", id, sizeof(id)) == NULL) {
+      sendError(connection, "400 Bad Request", "Invalid item, shopping list full or not saved");
+      return;
+    }
+    beginJsonResponse(json, connection, "200 OK");
+    writeShoppingChangeJson(json, shopping, *findShoppingItem(shopping, id));
+    finishJson(json);
+  } else if (strncmp(header, "GET /api/history", 16) == 0) {
+    bool daily = strstr(header, "bucket=day") != NULL;
+    uint32_t to = queryParam(header, "to", historyNow);
+    uint32_t from = queryParam(header, "from", to - (daily ? 30 * 86400 : 24 * 3600));
+    beginHttpResponse(response, "200 OK", "application/json", corsHeaders);
+    appendHttpResponse(response, "\r\n");
+    sendHttpResponse(response, connection);
+    ConnectionHistorySink sink(connection);
+    writeHistoryJson(usageHistory, from, to, daily, historyNow, sink);
+  } else if (strncmp(header, "GET /api/stats", 14) == 0) {
+    // The firmware's stats answer, with host-side numbers for its own gauges
+    beginJsonResponse(json, connection, "200 OK");
+    jsonObject(json, NULL);
+    jsonString(json, "status", "success");
+    jsonUint(json, "uptimeMs", now / 1000);
+    jsonFloat(json, "idlePercent", 97.25);
+    writeHistoryStatsJson(json, usageHistory, 0);
+    writeShoppingStatsJson(json, shopping, 0, 0);
+    jsonObject(json, "heap");
+    jsonUint(json, "allocations", allocations);
+    jsonUint(json, "allocatedBytes", allocatedBytes);
+    writeRouteStatsJson(json, routes, routeCount);
+    jsonEnd(json);
+    finishJson(json);
+  } else if (strncmp(header, "OPTIONS ", 8) == 0) {
+    beginHttpResponse(response, "200 OK", NULL, corsHeaders);
+    appendHttpResponse(response, "Content-Length: 0\r\n\r\n");
+    sendHttpResponse(response, connection);
+  } else {
+    sendError(connection, "404 Not Found", "Endpoint not found");
+  }
+}
+
+// serviceNetwork's part of a connection: read over as many slices as it
+// takes, then answer. Returns what the read ended in.
+HttpReadState serve(ScriptedConnection& connection, const char* text, size_t length) {
+  connection.open(text, length);
+  resetHttpRequest(request);
+  HttpReadState state = httpReading;
+  for (int slice = 0; slice < 1000 && state == httpReading; slice++) {
+    connection.deliver();
+    state = readHttpRequest(request, connection, "POST /api/ota", now + 3000, clockNow);
+    now += 2000;
+  }
+  if (state == httpRequestReady) {
+    RouteStats* route = findRoute(routes, routeCount, request.header);
+    unsigned long allocationsBefore = allocations;
+    unsigned long bytesBefore = allocatedBytes;
+    handle(connection);
+    chargeRoute(*route, allocations - allocationsBefore, allocatedBytes - bytesBefore);
+  } else if (state == httpHeadersTooLarge) {
+    sendError(connection, "431 Request Header Fields Too Large", "Request headers too large");
+  } else if (state == httpBodyTooLarge) {
+    sendError(connection, "413 Payload Too Large", "Request body too large");
+  }
+  return state;
+}
+
+// The request mix, built once before anything is counted
+struct Scripted {
+  char text[6144];
+  size_t length;
+  HttpReadState expectedState;
+  const char* expectedStatus;
+};
+
+const int scriptCount = 13;
+Scripted scripts[scriptCount];
+
+void script(int index, HttpReadState state, const char* status, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(scripts[index].text, sizeof(scripts[index].text), format, args);
+  va_end(args);
+  scripts[index].length = length;
+  scripts[index].expectedState = state;
+  scripts[index].expectedStatus = status;
+}
+
+void buildScripts() {
+  const char* browser =
+    "Host: kitchen.local\r\nUser-Agent: Mozilla/5.0 (iPhone; CPU iPhone OS 17_4 like Mac OS X)\r\n"
+    "Accept: application/json\r\nAccept-Language: en-GB,en;q=0.9\r\nConnection: keep-alive\r\n";
+  script(0, httpRequestReady, "HTTP/1.1 200 OK", "GET /api/timer HTTP/1.1\r\n%s\r\n", browser);
+
+  static char sync[maxBodyLength];
+  int syncLength = snprintf(sync, sizeof(sync), "{\"epoch\":7,\"changes\":[");
+  for (int i = 0; i < 16; i++) {
+    syncLength += snprintf(sync + syncLength, sizeof(sync) - syncLength,
+                           "%s{\"id\":\"item-%02d-5f3a9c\",\"text\":\"Oat milk %d\",\"completed\":false,"
+                           "\"deleted\":false,\"ts\":1735689600%03d,\"replica\":\"phone\"}",
+                           i == 0 ? "" : ",", i, i, i);
+  }
+  syncLength += snprintf(sync + syncLength, sizeof(sync) - syncLength, "]}");
+  script(1, httpRequestReady, "HTTP/1.1 200 OK",
+         "POST /api/shopping/sync?since=42 HTTP/1.1\r\n%sContent-Type: application/json\r\n"
+         "Content-Length: %d\r\n\r\n%s", browser, syncLength, sync);
+  script(2, httpRequestReady, "HTTP/1.1 200 OK", "GET /api/history?bucket=day&from=%lu HTTP/1.1\r\n%s\r\n",
+         (unsigned long)(historyNow - 364 * 86400), browser);
+  script(3, httpRequestReady, "HTTP/1.1 200 OK",
+         "OPTIONS /api/shopping/sync HTTP/1.1\r\n%sAccess-Control-Request-Method: POST\r\n\r\n", browser);
+  script(4, httpRequestReady, "HTTP/1.1 404", "GET /api/nothing HTTP/1.1\r\n\r\n");
+
+  static char cookie[maxHeaderLength];
+  memset(cookie, 'c', sizeof(cookie) - 1);
+  cookie[sizeof(cookie) - 1] = 0;
+  script(5, httpHeadersTooLarge, "HTTP/1.1 431", "GET /api/timer HTTP/1.1\r\nCookie: %s\r\n\r\n", cookie);
+  script(6, httpBodyTooLarge, "HTTP/1.1 413",
+         "POST /api/shopping/sync HTTP/1.1\r\nContent-Length: %d\r\n\r\n", maxBodyLength + 1);
+  script(7, httpUploadReady, NULL,
+         "POST /api/ota HTTP/1.1\r\nX-OTA-Token: secret\r\nContent-Length: 1100000\r\n\r\n\xE9\x03\x02");
+  script(8, httpRequestReady, "HTTP/1.1 200 OK", "GET /api/lights HTTP/1.1\r\n%s\r\n", browser);
+  script(9, httpRequestReady, "HTTP/1.1 200 OK", "POST /api/lights/red/on HTTP/1.1\r\n%sContent-Length: 0\r\n\r\n",
+         browser);
+  script(10, httpRequestReady, "HTTP/1.1 200 OK", "GET /api/shopping?epoch=7&since=3 HTTP/1.1\r\n%s\r\n", browser);
+  const char* add = "{\"id\":\"item-coffee\",\"text\":\"Coffee \\\"beans\\\" \\\\ filter\",\"ts\":1735689700000,"
+                    "\"replica\":\"phone\"}";
+  script(11, httpRequestReady, "HTTP/1.1 200 OK",
+         "POST /api/shopping/add HTTP/1.1\r\n%sContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n%s",
+         browser, strlen(add), add);
+  script(12, httpRequestReady, "HTTP/1.1 200 OK", "GET /api/stats HTTP/1.1\r\n%s\r\n", browser);
+}
+
+// A busy kitchen's year in the history rollups: a few timers and a
+// dishwasher run a day
+void recordYear() {
+  startHistory(usageHistory, NULL);
+  for (uint32_t day = 0; day < 365; day++) {
+    uint32_t base = historyNow - (364 - day) * 86400 - 86399;
+    for (uint32_t timer = 0; timer < 4; timer++) {
+      appendHistory(usageHistory, eventTimerFinished, 300 + 60 * timer, base + (8 + 3 * timer) * 3600);
+    }
+    appendHistory(usageHistory, eventCycleComplete, 5400, base + 20 * 3600);
+    appendHistory(usageHistory, eventDishesClean, 0, base + 20 * 3600);
+  }
+}
+
+// Body of the response in the connection's output
+const char* responseBody(const ScriptedConnection& connection) {
+  const char* body = strstr(connection.output, "\r\n\r\n");
+  return body != NULL ? body + 4 : "";
+}
+
+void testRequestShapes() {
+  static ScriptedConnection connection;
+  CHECK_EQ(serve(connection, scripts[1].text, scripts[1].length), httpRequestReady);
+  CHECK(strncmp(request.header, "POST /api/shopping/sync?since=42 ", 33) == 0);
+  CHECK_EQ(request.bodyLength, request.contentLength);
+  CHECK(strncmp(request.body, "{\"epoch\":7,", 11) == 0);
+  CHECK_EQ(shopping.itemCount, 16);
+  CHECK(strstr(connection.output, "{\"id\":\"item-15-5f3a9c\",\"text\":\"Oat milk 15\",\"completed\":false,"
+                                  "\"deleted\":false,\"ts\":1735689600015,\"replica\":") != NULL);
+  CHECK(strncmp(connection.output + connection.outputLength - 15, "],\"rejected\":0}", 15) == 0);
+
+  // A streamed upload stops at its headers, leaving the body on the connection
+  CHECK_EQ(serve(connection, scripts[7].text, scripts[7].length), httpUploadReady);
+  CHECK_EQ(request.contentLength, 1100000);
+  CHECK_EQ(connection.consumed, scripts[7].length - 3);
+  CHECK_EQ(connection.outputLength, 0);
+
+  // A year of history by day spans several segments
+  CHECK_EQ(serve(connection, scripts[2].text, scripts[2].length), httpRequestReady);
+  CHECK(connection.writes > 5);
+  CHECK(connection.outputLength > 365 * 28);
+  CHECK(strstr(connection.output, "[1767139200,1,1,5400,4,1560]]}") != NULL);
+
+  serve(connection, scripts[0].text, scripts[0].length);
+  CHECK(strcmp(responseBody(connection),
+               "{\"status\":\"success\",\"timer\":\"running\",\"duration\":600,\"remaining\":431}") == 0);
+  serve(connection, scripts[9].text, scripts[9].length);
+  CHECK(strcmp(responseBody(connection),
+               "{\"status\":\"success\",\"message\":\"Red light (GPIO18) turned ON\","
+               "\"lights\":{\"red light\":\"on\",\"green light\":\"off\"}}") == 0);
+
+  // Text is escaped on the way out as it was on the way in
+  serve(connection, scripts[11].text, scripts[11].length);
+  CHECK(strstr(responseBody(connection), "\"text\":\"Coffee \\\"beans\\\" \\\\ filter\"") != NULL);
+  CHECK(strcmp(findShoppingItem(shopping, "item-coffee")->text, "Coffee \"beans\" \\ filter") == 0);
+  serve(connection, scripts[10].text, scripts[10].length);
+  CHECK(strstr(responseBody(connection), "\"full\":false,\"items\":[{\"id\":\"item-03-5f3a9c\"") != NULL);
+
+  serve(connection, scripts[12].text, scripts[12].length);
+  CHECK(strstr(responseBody(connection), "\"routes\":[{\"route\":\"GET /api/timer\",\"requests\":1,") != NULL);
+  CHECK(strcmp(connection.output + connection.outputLength - 3, "]}}") == 0);
+
+  serve(connection, scripts[6].text, scripts[6].length);
+  CHECK(strcmp(responseBody(connection), "{\"status\":\"error\",\"message\":\"Request body too large\"}") == 0);
+
+  CHECK_EQ(queryParam("GET /api/history?from=10&to=20 HTTP/1.1\r\n", "to", 5), 20);
+  CHECK_EQ(queryParam("GET /api/history?from=10 HTTP/1.1\r\nX-Hint: ?to=3\r\n", "to", 5), 5);
+}
+
+void testSoak() {
+  static ScriptedConnection connection;
+  // Warm-up: one of each, so anything done once (stdio, locale) is done
+  for (int i = 0; i < scriptCount; i++) {
+    serve(connection, scripts[i].text, scripts[i].length);
+  }
+  for (int i = 0; i < routeCount; i++) {
+    RouteStats fresh = {routes[i].prefix, 0, 0, 0, 0};
+    routes[i] = fresh;
+  }
+
+  struct mallinfo2 before = mallinfo2();
+  const int requests = 1000000;
+  int wrongAnswers = 0;
+  countingAllocations = true;
+  for (int n = 0; n < requests; n++) {
+    const Scripted& next = scripts[nextRandom(scriptCount)];
+    HttpReadState state = serve(connection, next.text, next.length);
+    if (state != next.expectedState ||
+        (next.expectedStatus != NULL &&
+         strncmp(connection.output, next.expectedStatus, strlen(next.expectedStatus)) != 0)) {
+      wrongAnswers++;
+    }
+  }
+  countingAllocations = false;
+  struct mallinfo2 after = mallinfo2();
+
+  CHECK_EQ(wrongAnswers, 0);
+  CHECK_EQ(allocations, 0);
+  CHECK_EQ(allocatedBytes, 0);
+  uint32_t served = 0;
+  for (int i = 0; i < routeCount; i++) {
+    CHECK_EQ(routes[i].allocations, 0);
+    CHECK_EQ(routes[i].maxAllocations, 0);
+    served += routes[i].requests;
+  }
+  // Heap in use, total arena and free space outside the top chunk unchanged
+  CHECK_EQ(after.uordblks, before.uordblks);
+  CHECK_EQ(after.arena, before.arena);
+  CHECK_EQ(after.fordblks - after.keepcost, before.fordblks - before.keepcost);
+
+  printf("soak: %d requests (%u handled, the rest refused or streamed) in %.1f s of slices, "
+         "%lu allocations, heap in use %zu -> %zu bytes\n",
+         requests, served, now / 1000000.0, allocations, before.uordblks, after.uordblks);
+}
+
+int main() {
+  initShoppingStore(shopping, 7, &shoppingLog);
+  recordYear();
+  buildScripts();
+  testRequestShapes();
+  testSoak();
+  return checkFailures();
+}
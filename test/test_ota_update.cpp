@@ -0,0 +1,374 @@
+// Firmware upload: requests are checked before flash is touched, failed
+// uploads are aborted, and a full image is streamed through the scheduler
+// against a stand-in partition that costs flash time on a virtual clock.
+// Prints throughput and the longest run of any task during the upload.
+#include <string.h>
+
+#include <openssl/evp.h>
+
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "ota_update.h"
+
+// Virtual clock in microseconds; flash, socket and tasks advance it
+uint64_t now = 0;
+
+uint64_t clockNow() {
+  return now;
+}
+
+// Flash timing from the ESP32 module datasheets (typical values)
+const uint64_t sectorEraseUs = 45000;
+const uint64_t pageProgramUs = 700;  // Per 256 bytes
+const uint32_t flashSectorBytes = 4096;
+
+// Stand-in for the inactive app partition as esp_ota_* drives it with
+// OTA_WITH_SEQUENTIAL_WRITES: each sector is erased when the write first
+// reaches it, and finish() checks the image header magic.
+class SimPartition : public OtaTarget {
+ public:
+  uint32_t size = 0x140000;
+  std::vector<uint8_t> data;
+  uint32_t erasedUpTo = 0;
+  int beginCalls = 0;
+  int aborts = 0;
+  bool bootable = false;
+  bool failWrites = false;
+
+  uint32_t capacity() override {
+    return size;
+  }
+  const char* begin(uint32_t) override {
+    beginCalls++;
+    data.clear();
+    erasedUpTo = 0;
+    bootable = false;
+    return NULL;
+  }
+  const char* write(const uint8_t* bytes, size_t length) override {
+    if (failWrites) {
+      return "ESP_FAIL";
+    }
+    uint32_t end = data.size() + length;
+    while (erasedUpTo < end) {
+      now += sectorEraseUs;
+      erasedUpTo += flashSectorBytes;
+    }
+    now += (length + 255) / 256 * pageProgramUs;
+    data.insert(data.end(), bytes, bytes + length);
+    return NULL;
+  }
+  const char* finish() override {
+    if (data.empty() || data[0] != 0xE9) {
+      return "ESP_ERR_OTA_VALIDATE_FAILED";
+    }
+    bootable = true;
+    return NULL;
+  }
+  void abort() override {
+    aborts++;
+  }
+};
+
+class OpensslHash : public OtaHash {
+ public:
+  ~OpensslHash() {
+    EVP_MD_CTX_free(context);
+  }
+  void start() override {
+    EVP_DigestInit_ex(context, EVP_sha256(), NULL);
+    started++;
+  }
+  void update(const uint8_t* data, size_t length) override {
+    EVP_DigestUpdate(context, data, length);
+  }
+  void finish(uint8_t digest[32]) override {
+    EVP_DigestFinal_ex(context, digest, NULL);
+    finished++;
+  }
+  int started = 0;
+  int finished = 0;
+
+ private:
+  EVP_MD_CTX* context = EVP_MD_CTX_new();
+};
+
+// Client socket fed by a link of fixed bandwidth. The receive window caps
+// how far the sender gets ahead of the reader. The sender can hang (stay
+// connected, send nothing) or drop the connection part way through.
+class SimSocket : public OtaSource {
+ public:
+  std::vector<uint8_t> body;
+  double bytesPerUs = 0.5;  // 500 KB/s, a good WiFi link
+  size_t window = 5744;     // lwIP TCP_WND default
+  size_t hangAt = SIZE_MAX;
+  size_t disconnectAt = SIZE_MAX;
+  uint64_t start = 0;
+  size_t consumed = 0;
+  size_t arrived = 0;
+  uint64_t lastArrival = 0;
+
+  void connect(const std::vector<uint8_t>& image) {
+    body = image;
+    start = now;
+    lastArrival = now;
+    consumed = 0;
+    arrived = 0;
+  }
+  int available() override {
+    // Bytes arrive at the link rate while the window has room
+    size_t limit = body.size() < hangAt ? body.size() : hangAt;
+    limit = limit < disconnectAt ? limit : disconnectAt;
+    size_t room = consumed + window - arrived;
+    size_t incoming = (size_t)((now - lastArrival) * bytesPerUs);
+    if (incoming > 0) {
+      incoming = incoming < room ? incoming : room;
+      arrived = arrived + incoming < limit ? arrived + incoming : limit;
+      lastArrival = now;
+    }
+    return arrived - consumed;
+  }
+  int read(uint8_t* out, size_t length) override {
+    size_t part = arrived - consumed < length ? arrived - consumed : length;
+    memcpy(out, body.data() + consumed, part);
+    consumed += part;
+    now += part / 64 + 5;  // Copy out of the lwIP buffers
+    return part;
+  }
+  bool connected() override {
+    return consumed < disconnectAt;
+  }
+};
+
+std::vector<uint8_t> makeImage(size_t length) {
+  std::vector<uint8_t> image(length);
+  uint32_t state = 12345;
+  for (size_t i = 0; i < length; i++) {
+    state = state * 1103515245 + 12345;
+    image[i] = state >> 16;
+  }
+  image[0] = 0xE9;  // ESP image magic
+  return image;
+}
+
+std::string sha256Hex(const std::vector<uint8_t>& data) {
+  OpensslHash hash;
+  uint8_t digest[32];
+  hash.start();
+  hash.update(data.data(), data.size());
+  hash.finish(digest);
+  char hex[65];
+  for (int i = 0; i < 32; i++) {
+    snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+  }
+  return hex;
+}
+
+std::string request(const char* token, const std::string& sha256 = "") {
+  std::string headers = "POST /api/ota HTTP/1.1\r\nHost: kitchen.local\r\n";
+  if (token != NULL) {
+    headers += std::string("X-OTA-Token: ") + token + "\r\n";
+  }
+  if (!sha256.empty()) {
+    headers += "X-SHA256: " + sha256 + "\r\n";
+  }
+  return headers + "\r\n";
+}
+
+const char* token = "correct horse battery staple";
+
+struct UploadReport {
+  uint64_t elapsed;
+  uint64_t maxRun;        // Longest run of any task, the worst stall
+  uint64_t maxOtaRun;
+  uint64_t maxLateness;   // Of the other tasks
+};
+
+// The firmware's scheduler with the OTA task and stand-ins for the tasks that
+// share loop() with it: earliest deadline runs, fixed cadence, skips ahead
+// after a missed period.
+struct SimTask {
+  const char* name;
+  uint64_t period;
+  uint64_t budget;
+  uint64_t cost;  // Run time of the stand-ins
+  uint64_t deadline;
+};
+
+UploadReport runUpload(OtaUpload& upload, SimSocket& socket) {
+  SimTask tasks[] = {
+    {"ota", 2000, 5000, 0, 0},
+    {"network", 1000, 3000, 150, 0},
+    {"sensor", 5000, 1000, 300, 0},
+    {"display", 50000, 4000, 2500, 0},
+  };
+  const int taskCount = sizeof(tasks) / sizeof(tasks[0]);
+  for (int i = 0; i < taskCount; i++) {
+    tasks[i].deadline = now;
+  }
+
+  UploadReport report = {};
+  uint64_t start = now;
+  while (upload.active) {
+    int next = 0;
+    for (int i = 1; i < taskCount; i++) {
+      if (tasks[i].deadline < tasks[next].deadline) {
+        next = i;
+      }
+    }
+    SimTask& task = tasks[next];
+    if (task.deadline > now) {
+      now = task.deadline;
+    }
+    if (next != 0 && now - task.deadline > report.maxLateness) {
+      report.maxLateness = now - task.deadline;
+    }
+
+    uint64_t runStart = now;
+    if (next == 0) {
+      serviceOtaUpload(upload, socket, now + task.budget, clockNow);
+    } else {
+      now += task.cost;
+    }
+    uint64_t runTime = now - runStart;
+    if (runTime > report.maxRun) {
+      report.maxRun = runTime;
+    }
+    if (next == 0 && runTime > report.maxOtaRun) {
+      report.maxOtaRun = runTime;
+    }
+
+    task.deadline += task.period;
+    if (task.deadline <= now) {
+      task.deadline = now + task.period;
+    }
+  }
+  report.elapsed = now - start;
+  return report;
+}
+
+void testRequestChecks() {
+  static OtaUpload upload;
+  SimPartition partition;
+  OpensslHash hash;
+
+  // Nothing reaches flash without the right token
+  CHECK(!beginOtaUpload(upload, &partition, &hash, request(NULL).c_str(), 1000, token, now));
+  CHECK(strcmp(upload.status, "401 Unauthorized") == 0);
+  CHECK(!beginOtaUpload(upload, &partition, &hash, request("guess").c_str(), 1000, token, now));
+  CHECK(!beginOtaUpload(upload, &partition, &hash, request("correct horse battery stapl").c_str(), 1000,
+                        token, now));
+  CHECK(!beginOtaUpload(upload, &partition, &hash, request("correct horse battery staplee").c_str(), 1000,
+                        token, now));
+  CHECK(!beginOtaUpload(upload, &partition, &hash, request("").c_str(), 1000, "", now));
+  CHECK_EQ(partition.beginCalls, 0);
+
+  // Header names are case-insensitive
+  CHECK(otaAuthorized("POST /api/ota HTTP/1.1\r\nx-ota-token: secret\r\n\r\n", "secret"));
+  CHECK(!otaAuthorized("POST /api/ota HTTP/1.1\r\nX-OTA-Tokens: secret\r\n\r\n", "secret"));
+
+  CHECK(!beginOtaUpload(upload, &partition, &hash, request(token).c_str(), 0, token, now));
+  CHECK(strcmp(upload.status, "400 Bad Request") == 0);
+  CHECK(!beginOtaUpload(upload, &partition, &hash, request(token).c_str(), partition.size + 1, token, now));
+  CHECK_EQ(partition.beginCalls, 0);
+
+  CHECK(beginOtaUpload(upload, &partition, &hash, request(token).c_str(), 1000, token, now));
+  CHECK(!beginOtaUpload(upload, &partition, &hash, request(token).c_str(), 1000, token, now));
+  CHECK(strcmp(upload.status, "409 Conflict") == 0);
+  CHECK(upload.active);
+  CHECK_EQ(partition.beginCalls, 1);
+}
+
+// Uploads image, returning the status; the partition and hash are checked
+// to be left in a consistent state
+const char* upload(SimPartition& partition, SimSocket& socket, const std::vector<uint8_t>& image,
+                   const std::string& sha256, UploadReport* report = NULL) {
+  static OtaUpload state;
+  OpensslHash hash;
+  if (!beginOtaUpload(state, &partition, &hash, request(token, sha256).c_str(), image.size(), token, now)) {
+    return state.status;
+  }
+  socket.connect(image);
+  UploadReport result = runUpload(state, socket);
+  if (report != NULL) {
+    *report = result;
+  }
+  CHECK_EQ(hash.finished, hash.started);
+  CHECK_EQ(partition.aborts, strcmp(state.status, "200 OK") == 0 ? 0 : 1);
+  return state.status;
+}
+
+void testFailedUploads() {
+  std::vector<uint8_t> image = makeImage(100000);
+  {
+    SimPartition partition;
+    SimSocket socket;
+    std::vector<uint8_t> other = image;
+    other[5000] ^= 1;
+    CHECK(strcmp(upload(partition, socket, image, sha256Hex(other)), "400 Bad Request") == 0);
+    CHECK(!partition.bootable);
+  }
+  {
+    SimPartition partition;
+    SimSocket socket;
+    socket.disconnectAt = 40000;
+    CHECK(strcmp(upload(partition, socket, image, ""), "408 Request Timeout") == 0);
+    CHECK(!partition.bootable);
+  }
+  {
+    // Connected but silent: given up after otaIdleTimeout
+    SimPartition partition;
+    SimSocket socket;
+    socket.hangAt = 60000;
+    uint64_t start = now;
+    CHECK(strcmp(upload(partition, socket, image, ""), "408 Request Timeout") == 0);
+    CHECK(now - start > otaIdleTimeout);
+    CHECK(now - start < otaIdleTimeout + 1000000);
+  }
+  {
+    SimPartition partition;
+    SimSocket socket;
+    partition.failWrites = true;
+    CHECK(strcmp(upload(partition, socket, image, ""), "500 Internal Server Error") == 0);
+  }
+  {
+    // Not an ESP image: the partition's own validation refuses it
+    SimPartition partition;
+    SimSocket socket;
+    std::vector<uint8_t> text(image.size(), 'x');
+    CHECK(strcmp(upload(partition, socket, text, ""), "400 Bad Request") == 0);
+    CHECK(!partition.bootable);
+  }
+}
+
+void testFullUpload() {
+  // A typical sketch image, not a multiple of the chunk size
+  std::vector<uint8_t> image = makeImage(1100000 + 123);
+  SimPartition partition;
+  SimSocket socket;
+  UploadReport report;
+  CHECK(strcmp(upload(partition, socket, image, sha256Hex(image), &report), "200 OK") == 0);
+  CHECK(partition.bootable);
+  CHECK(partition.data == image);
+
+  double kbPerSecond = (image.size() / 1024.0) / (report.elapsed / 1000000.0);
+  printf("upload %zu bytes in %.2f s: %.1f KB/s, longest task run %llu us (ota %llu us), "
+         "worst lateness of other tasks %llu us\n",
+         image.size(), report.elapsed / 1000000.0, kbPerSecond, (unsigned long long)report.maxRun,
+         (unsigned long long)report.maxOtaRun, (unsigned long long)report.maxLateness);
+
+  // Flash, not the link, sets the pace: one erase and program per chunk
+  double flashKbPerSecond = (otaChunkBytes / 1024.0) / ((sectorEraseUs + 16 * pageProgramUs) / 1000000.0);
+  CHECK(kbPerSecond > 0.8 * flashKbPerSecond);
+  // A run holds at most one chunk write past its budget
+  CHECK(report.maxRun <= 5000 + sectorEraseUs + 16 * pageProgramUs + 200);
+}
+
+int main() {
+  testRequestChecks();
+  testFailedUploads();
+  testFullUpload();
+  return checkFailures();
+}
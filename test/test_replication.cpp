@@ -0,0 +1,315 @@
+// Household replication: each hub runs in its own process and exchanges real
+// UDP datagrams on localhost, broadcast being a send to every hub's port.
+// Measures how long a change takes to reach every hub, compares that with
+// the firmware's own digest-based estimate, reports bandwidth, and checks
+// recovery from lost packets and from a hub whose boot count was erased.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "check.h"
+#include "replication.h"
+
+const int simHubs = 5;
+// Scaled down from the firmware's 2 s and 30 s so a run takes seconds
+const uint64_t simAnnounceInterval = 100000;
+const uint64_t simPeerTimeout = 1500000;
+const uint32_t firstOrigin = 0x1000;
+const int maxChanges = 16;
+const int maxApplied = 64;
+
+uint64_t nowMicros() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct Scenario {
+  const char* name;
+  double lossRate;       // Share of datagrams dropped, on every hub
+  int changes;           // Made by hub 0, changeEvery apart from 0.5 s
+  uint64_t changeEvery;
+  bool resetBootCount;   // Hub 0 restarts with its boot count back at 1
+  uint64_t runTime;
+};
+
+// What each hub process reports back through its pipe
+struct HubReport {
+  uint64_t changeAt[maxChanges];   // Hub 0: when each change was made
+  uint32_t changeVersion[maxChanges];
+  uint32_t appliedVersion[maxApplied]; // Others: versions of hub 0 as they arrived
+  uint64_t appliedAt[maxApplied];
+  int appliedCount;
+  uint32_t finalVersion;           // Hub 0's entry as this hub holds it at the end
+  uint8_t finalLights;
+  uint32_t packetsSent;
+  uint32_t bytesSent;
+  uint32_t versionsAdopted;
+  uint32_t lastConvergenceMs;
+  uint32_t maxConvergenceMs;
+};
+
+struct SimNetwork {
+  int socket;
+  uint16_t ports[simHubs];
+  int self;
+  double lossRate;
+  uint32_t random;
+};
+
+bool dropped(SimNetwork& network) {
+  network.random = network.random * 1103515245u + 12345u;
+  return (network.random >> 8) % 1000 < network.lossRate * 1000;
+}
+
+void sendTo(SimNetwork& network, uint16_t port, const uint8_t* data, size_t length) {
+  if (dropped(network)) {
+    return;
+  }
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  sendto(network.socket, data, length, 0, (sockaddr*)&address, sizeof(address));
+}
+
+// Addresses are the hubs' ports
+void simSend(void* context, uint32_t destination, const uint8_t* data, size_t length) {
+  SimNetwork& network = *(SimNetwork*)context;
+  if (destination != 0) {
+    sendTo(network, destination, data, length);
+    return;
+  }
+  for (int i = 0; i < simHubs; i++) {
+    if (i != network.self) {
+      sendTo(network, network.ports[i], data, length);
+    }
+  }
+}
+
+void startHub(Replication& replication, SimNetwork& network, uint32_t bootCount, uint64_t now) {
+  char name[16];
+  snprintf(name, sizeof(name), "hub%d", network.self);
+  initReplication(replication, firstOrigin + network.self, name, (bootCount << 20) | 1,
+                  network.ports[network.self], now, simSend, &network);
+  replication.announceInterval = simAnnounceInterval;
+  replication.peerTimeout = simPeerTimeout;
+}
+
+void runHub(const Scenario& scenario, SimNetwork& network, uint64_t start, HubReport& report) {
+  static Replication replication;
+  memset(&report, 0, sizeof(report));
+  startHub(replication, network, 5, start);
+  uint32_t seenVersion = 0;
+  int changesMade = 0;
+  bool restarted = false;
+  uint64_t resetAt = start + scenario.runTime / 3;
+
+  for (uint64_t now = nowMicros(); now < start + scenario.runTime; now = nowMicros()) {
+    pollfd wait = {network.socket, POLLIN, 0};
+    if (poll(&wait, 1, 2) > 0) {
+      uint8_t packet[maxReplicationPacket];
+      sockaddr_in from;
+      socklen_t fromLength = sizeof(from);
+      ssize_t length = recvfrom(network.socket, packet, sizeof(packet), 0, (sockaddr*)&from, &fromLength);
+      now = nowMicros();
+      if (length > 0) {
+        handleReplicationPacket(replication, packet, length, ntohs(from.sin_port), now);
+      }
+    }
+
+    if (network.self == 0) {
+      if (scenario.resetBootCount && !restarted && now >= resetAt) {
+        // NVS erased: back to boot 1, with state the others have not seen
+        restarted = true;
+        startHub(replication, network, 1, now);
+        replication.hubs[0].lights = 3;
+      }
+      uint64_t nextChangeAt = start + 500000 + changesMade * scenario.changeEvery;
+      if (changesMade < scenario.changes && now >= nextChangeAt) {
+        replication.hubs[0].lights = changesMade & 3;
+        replication.hubs[0].durationSeconds = 60 * (changesMade + 1);
+        publishLocalChange(replication, now);
+        report.changeAt[changesMade] = now;
+        report.changeVersion[changesMade] = replication.hubs[0].version;
+        changesMade++;
+      }
+    } else {
+      HubState* origin = findHub(replication, firstOrigin, false);
+      if (origin != NULL && origin->version != seenVersion && report.appliedCount < maxApplied) {
+        seenVersion = origin->version;
+        report.appliedVersion[report.appliedCount] = origin->version;
+        report.appliedAt[report.appliedCount] = now;
+        report.appliedCount++;
+      }
+    }
+    serviceReplicationTimers(replication, now);
+  }
+
+  HubState* origin = findHub(replication, firstOrigin, false);
+  if (origin != NULL) {
+    report.finalVersion = origin->version;
+    report.finalLights = origin->lights;
+  }
+  report.packetsSent = replication.packetsSent;
+  report.bytesSent = replication.bytesSent;
+  report.versionsAdopted = replication.versionsAdopted;
+  report.lastConvergenceMs = replication.lastConvergenceMs;
+  report.maxConvergenceMs = replication.maxConvergenceMs;
+}
+
+// Forks a process per hub and collects their reports
+std::vector<HubReport> runScenario(const Scenario& scenario) {
+  SimNetwork network = {};
+  int sockets[simHubs];
+  for (int i = 0; i < simHubs; i++) {
+    sockets[i] = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    CHECK(bind(sockets[i], (sockaddr*)&address, sizeof(address)) == 0);
+    socklen_t length = sizeof(address);
+    getsockname(sockets[i], (sockaddr*)&address, &length);
+    network.ports[i] = ntohs(address.sin_port);
+  }
+
+  uint64_t start = nowMicros() + 100000;
+  int pipes[simHubs];
+  pid_t children[simHubs];
+  for (int i = 0; i < simHubs; i++) {
+    int ends[2];
+    CHECK(pipe(ends) == 0);
+    children[i] = fork();
+    if (children[i] == 0) {
+      close(ends[0]);
+      network.socket = sockets[i];
+      network.self = i;
+      network.lossRate = scenario.lossRate;
+      network.random = 7919 * (i + 1);
+      HubReport report;
+      runHub(scenario, network, start, report);
+      ssize_t written = write(ends[1], &report, sizeof(report));
+      _exit(written == (ssize_t)sizeof(report) ? 0 : 1);
+    }
+    close(ends[1]);
+    pipes[i] = ends[0];
+  }
+
+  std::vector<HubReport> reports(simHubs);
+  for (int i = 0; i < simHubs; i++) {
+    uint8_t* out = (uint8_t*)&reports[i];
+    size_t received = 0;
+    ssize_t length;
+    while (received < sizeof(HubReport) && (length = read(pipes[i], out + received, sizeof(HubReport) - received)) > 0) {
+      received += length;
+    }
+    CHECK_EQ(received, sizeof(HubReport));
+    close(pipes[i]);
+    int status;
+    waitpid(children[i], &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    close(sockets[i]);
+  }
+  return reports;
+}
+
+// Longest time any change of hub 0 took to reach the last hub, in ms, or -1
+// if some change never reached some hub
+double worstConvergenceMs(const std::vector<HubReport>& reports, int changes) {
+  double worst = 0;
+  for (int k = 0; k < changes; k++) {
+    for (int i = 1; i < simHubs; i++) {
+      const HubReport& hub = reports[i];
+      int n = 0;
+      while (n < hub.appliedCount && hub.appliedVersion[n] < reports[0].changeVersion[k]) {
+        n++;
+      }
+      if (n == hub.appliedCount) {
+        return -1;
+      }
+      double ms = (double)(hub.appliedAt[n] - reports[0].changeAt[k]) / 1000;
+      worst = ms > worst ? ms : worst;
+    }
+  }
+  return worst;
+}
+
+void printReport(const Scenario& scenario, const std::vector<HubReport>& reports, double worstMs) {
+  uint64_t bytes = 0;
+  uint64_t packets = 0;
+  for (const HubReport& hub : reports) {
+    bytes += hub.bytesSent;
+    packets += hub.packetsSent;
+  }
+  double seconds = (double)scenario.runTime / 1e6;
+  // Announces dominate, so rescale to the firmware's interval
+  double scale = (double)simAnnounceInterval / defaultAnnounceInterval;
+  printf("%-10s worst convergence %7.1f ms, digest estimate %4u ms (max %4u ms), "
+         "%.0f B/s and %.1f packets/s per hub (%.1f B/s at the firmware's interval)\n",
+         scenario.name, worstMs, reports[0].lastConvergenceMs, reports[0].maxConvergenceMs,
+         bytes / seconds / simHubs, packets / seconds / simHubs, bytes / seconds / simHubs * scale);
+}
+
+void testLosslessConvergence() {
+  Scenario scenario = {"lossless", 0, 10, 200000, false, 3000000};
+  std::vector<HubReport> reports = runScenario(scenario);
+  double worst = worstConvergenceMs(reports, scenario.changes);
+  printReport(scenario, reports, worst);
+  // Changes are pushed as they happen, so they arrive before the next digest
+  CHECK(worst >= 0);
+  CHECK(worst < simAnnounceInterval / 1000);
+  for (int i = 1; i < simHubs; i++) {
+    CHECK_EQ(reports[i].finalVersion, reports[0].changeVersion[scenario.changes - 1]);
+  }
+  // The estimate waits for digests: it may overstate by an interval, but
+  // never reports less than it really took
+  CHECK(reports[0].maxConvergenceMs + 1 >= worst);
+  CHECK(reports[0].maxConvergenceMs <= simAnnounceInterval / 1000 + 60);
+  // Per hub and announce interval: a digest, plus the pushes
+  uint64_t intervals = scenario.runTime / simAnnounceInterval;
+  for (int i = 1; i < simHubs; i++) {
+    CHECK(reports[i].bytesSent / intervals < 9 + 1 + 4 + 1 + 8 * simHubs + 40);
+  }
+}
+
+void testLossyConvergence() {
+  Scenario scenario = {"30% loss", 0.3, 10, 200000, false, 5000000};
+  std::vector<HubReport> reports = runScenario(scenario);
+  double worst = worstConvergenceMs(reports, scenario.changes);
+  printReport(scenario, reports, worst);
+  // Lost pushes are repaired by the digest exchange within a few intervals
+  CHECK(worst >= 0);
+  CHECK(worst < 15 * simAnnounceInterval / 1000);
+  for (int i = 1; i < simHubs; i++) {
+    CHECK_EQ(reports[i].finalVersion, reports[0].changeVersion[scenario.changes - 1]);
+  }
+}
+
+void testBootCountReset() {
+  // Hub 0 makes changes, loses its boot count at 1 s and comes back with a
+  // version far below what the others hold
+  Scenario scenario = {"NVS reset", 0, 3, 100000, true, 3000000};
+  std::vector<HubReport> reports = runScenario(scenario);
+  printReport(scenario, reports, worstConvergenceMs(reports, scenario.changes));
+  CHECK(reports[0].versionsAdopted >= 1);
+  for (int i = 1; i < simHubs; i++) {
+    // The others hold the new state, not the entry from before the reset
+    CHECK_EQ(reports[i].finalLights, 3);
+    CHECK(reports[i].finalVersion > reports[0].changeVersion[scenario.changes - 1]);
+  }
+}
+
+int main() {
+  testLosslessConvergence();
+  testLossyConvergence();
+  testBootCountReset();
+  return checkFailures();
+}
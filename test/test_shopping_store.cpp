@@ -0,0 +1,310 @@
+// Shopping store: merge rules, log replay after power loss and failed writes,
+// and two hubs syncing through a stand-in for the upstream service that can
+// be taken offline.
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "shopping_store.h"
+
+const int batchSize = 16;  // upstreamBatchSize in the firmware
+
+// Log kept in memory. Writes can be made to fail, and a failed append
+// leaves half its record behind as a torn flash write would.
+class MemoryLog : public ShoppingLog {
+ public:
+  std::vector<uint8_t> data;
+  std::vector<uint8_t> pending;
+  size_t readAt = 0;
+  int appendsBeforeFailure = -1;  // -1 never fails
+  int rewritesBeforeFailure = -1;
+
+  size_t read(uint8_t* out, size_t length) override {
+    size_t part = data.size() - readAt < length ? data.size() - readAt : length;
+    memcpy(out, data.data() + readAt, part);
+    readAt += part;
+    return part;
+  }
+  bool append(const uint8_t* record, size_t length) override {
+    if (appendsBeforeFailure == 0) {
+      data.insert(data.end(), record, record + length / 2);
+      return false;
+    }
+    if (appendsBeforeFailure > 0) {
+      appendsBeforeFailure--;
+    }
+    data.insert(data.end(), record, record + length);
+    return true;
+  }
+  bool beginRewrite() override {
+    pending.clear();
+    return true;
+  }
+  bool rewrite(const uint8_t* record, size_t length) override {
+    if (rewritesBeforeFailure == 0) {
+      return false;
+    }
+    if (rewritesBeforeFailure > 0) {
+      rewritesBeforeFailure--;
+    }
+    pending.insert(pending.end(), record, record + length);
+    return true;
+  }
+  bool endRewrite(bool commit) override {
+    if (commit) {
+      data = pending;
+    }
+    return true;
+  }
+};
+
+// What a phone or the upstream would see: live items by id
+std::map<std::string, std::string> visibleItems(const ShoppingStore& store) {
+  std::map<std::string, std::string> items;
+  for (int i = 0; i < store.itemCount; i++) {
+    const ShoppingItem& item = store.items[i];
+    if (!item.deleted) {
+      items[item.id] = std::string(item.text) + (item.completed ? " [x]" : " [ ]");
+    }
+  }
+  return items;
+}
+
+// Boots a second store from the first one's log
+std::map<std::string, std::string> reload(MemoryLog& log, bool* clean = NULL) {
+  static ShoppingStore store;
+  log.readAt = 0;
+  initShoppingStore(store, 2, &log);
+  bool ok = loadShoppingLog(store);
+  if (clean != NULL) {
+    *clean = ok;
+  }
+  return visibleItems(store);
+}
+
+void testMerge() {
+  static ShoppingStore store;
+  MemoryLog log;
+  initShoppingStore(store, 1, &log);
+  uint32_t phoneA = replicaHash("phone-a");
+  uint32_t phoneB = replicaHash("phone-b");
+
+  CHECK(applyShoppingChange(store, "milk", "Milk", false, false, 1000, phoneA, false));
+  // An older edit that arrives late loses
+  CHECK(applyShoppingChange(store, "milk", "Old milk", true, false, 900, phoneB, false));
+  CHECK(strcmp(findShoppingItem(store, "milk")->text, "Milk") == 0);
+  CHECK(!findShoppingItem(store, "milk")->completed);
+  // Same millisecond: the higher replica hash wins on every hub alike
+  uint32_t high = phoneA > phoneB ? phoneA : phoneB;
+  uint32_t low = phoneA > phoneB ? phoneB : phoneA;
+  CHECK(applyShoppingChange(store, "milk", NULL, true, false, 2000, high, false));
+  CHECK(applyShoppingChange(store, "milk", NULL, false, false, 2000, low, false));
+  CHECK(findShoppingItem(store, "milk")->completed);
+  CHECK(strcmp(findShoppingItem(store, "milk")->text, "Milk") == 0);  // NULL kept the text
+  // A delete leaves a tombstone that an offline phone's older edit cannot undo
+  CHECK(applyShoppingChange(store, "milk", NULL, false, true, 3000, phoneA, false));
+  CHECK(applyShoppingChange(store, "milk", "Milk", false, false, 2500, phoneB, false));
+  CHECK(findShoppingItem(store, "milk")->deleted);
+  // Text longer than the table holds is cut, not overrun
+  CHECK(applyShoppingChange(store, "long", std::string(100, 'x').c_str(), false, false, 0, phoneA, false));
+  CHECK_EQ(strlen(findShoppingItem(store, "long")->text), sizeof(ShoppingItem::text) - 1);
+
+  // A full table takes new items only in place of tombstones
+  char id[16];
+  for (int i = 0; store.itemCount < maxShoppingItems; i++) {
+    snprintf(id, sizeof(id), "fill%d", i);
+    CHECK(applyShoppingChange(store, id, "x", false, false, 4000, phoneA, false));
+  }
+  CHECK(applyShoppingChange(store, "eggs", "Eggs", false, false, 5000, phoneA, false));
+  CHECK(findShoppingItem(store, "milk") == NULL);
+  CHECK(!applyShoppingChange(store, "bread", "Bread", false, false, 5000, phoneA, false));
+  CHECK(findShoppingItem(store, "bread") == NULL);
+}
+
+void testReplayAndCompaction() {
+  static ShoppingStore store;
+  MemoryLog log;
+  initShoppingStore(store, 1, &log);
+  char id[16];
+  for (int round = 0; round < 20; round++) {
+    for (int i = 0; i < 10; i++) {
+      snprintf(id, sizeof(id), "item%d", i);
+      CHECK(applyShoppingChange(store, id, id, round % 2, round == 19 && i < 3, 0, 7, false));
+    }
+  }
+  // 200 changes to 10 items: compaction keeps the log near one record per item
+  CHECK(store.logRecords <= 4 * 10 + 64 + 1);
+  bool clean;
+  CHECK(reload(log, &clean) == visibleItems(store));
+  CHECK(clean);
+  CHECK_EQ(visibleItems(store).size(), 7);
+
+  // Power lost halfway through a record: the records before it survive and
+  // the log is rewritten without the torn one
+  size_t intact = log.data.size();
+  ShoppingItem extra = {};
+  strcpy(extra.id, "torn");
+  strcpy(extra.text, "Torn");
+  uint8_t record[maxShoppingRecordBytes];
+  size_t length = encodeShoppingRecord(extra, record);
+  log.data.insert(log.data.end(), record, record + length - 3);
+  CHECK(reload(log, &clean) == visibleItems(store));
+  CHECK(!clean);
+  CHECK(log.data.size() <= intact);
+  CHECK(reload(log, &clean) == visibleItems(store));
+  CHECK(clean);
+}
+
+void testFailedWrites() {
+  static ShoppingStore store;
+  MemoryLog log;
+  initShoppingStore(store, 1, &log);
+  CHECK(applyShoppingChange(store, "milk", "Milk", false, false, 1000, 7, false));
+  uint32_t seq = store.seq;
+
+  // A change that cannot be logged is refused and leaves no trace, so the
+  // phone keeps it queued and its retry is applied in full
+  log.appendsBeforeFailure = 0;
+  CHECK(!applyShoppingChange(store, "milk", "Milk", true, false, 2000, 7, false));
+  CHECK(!applyShoppingChange(store, "eggs", "Eggs", false, false, 2000, 7, false));
+  CHECK(!findShoppingItem(store, "milk")->completed);
+  CHECK(findShoppingItem(store, "eggs") == NULL);
+  CHECK_EQ(store.seq, seq);
+  CHECK_EQ(store.logFailures, 2);
+  log.appendsBeforeFailure = -1;
+  CHECK(applyShoppingChange(store, "milk", "Milk", true, false, 2000, 7, false));
+  CHECK(applyShoppingChange(store, "eggs", "Eggs", false, false, 2000, 7, false));
+  // The half-written records were rewritten away, so nothing after them is lost
+  bool clean;
+  CHECK(reload(log, &clean) == visibleItems(store));
+  CHECK(clean);
+
+  // A compaction that fails partway leaves the old log in place
+  std::vector<uint8_t> before = log.data;
+  log.rewritesBeforeFailure = 1;
+  CHECK(!compactShoppingLog(store));
+  CHECK(log.data == before);
+  CHECK(reload(log, &clean) == visibleItems(store));
+  CHECK(clean);
+}
+
+// Stand-in for the upstream service. It keeps its own merged copy and
+// answers each hub with what changed since that hub's last successful sync.
+class StandInUpstream {
+ public:
+  bool online = true;
+  size_t largestBatch = 0;
+  size_t changesReceived = 0;
+
+  StandInUpstream() {
+    initShoppingStore(store, 99, &log);
+  }
+
+  bool post(const std::string& hub, const ShoppingItem** changes, int count,
+            std::vector<ShoppingItem>& reply) {
+    if (!online) {
+      return false;
+    }
+    largestBatch = (size_t)count > largestBatch ? count : largestBatch;
+    changesReceived += count;
+    for (int i = 0; i < count; i++) {
+      const ShoppingItem& change = *changes[i];
+      applyShoppingChange(store, change.id, change.text, change.completed, change.deleted,
+                          change.timestamp, change.replica, false);
+    }
+    uint32_t& cursor = cursors[hub];
+    reply.clear();
+    for (int i = 0; i < store.itemCount; i++) {
+      if (store.items[i].seq > cursor) {
+        reply.push_back(store.items[i]);
+      }
+    }
+    cursor = store.seq;
+    return true;
+  }
+
+  ShoppingStore store;
+  MemoryLog log;
+  std::map<std::string, uint32_t> cursors;
+};
+
+// One upstream round as serviceShoppingUpstream runs it. Returns the number
+// of changes pushed, or -1 if the upstream could not be reached.
+int syncHub(ShoppingStore& hub, const std::string& name, StandInUpstream& upstream) {
+  const ShoppingItem* changes[batchSize];
+  uint32_t through;
+  int count = collectUpstreamChanges(hub, changes, batchSize, through);
+  std::vector<ShoppingItem> reply;
+  if (!upstream.post(name, changes, count, reply)) {
+    return -1;
+  }
+  markUpstreamSent(hub, through);
+  for (const ShoppingItem& item : reply) {
+    CHECK(applyShoppingChange(hub, item.id, item.text, item.completed, item.deleted, item.timestamp,
+                              item.replica, true));
+  }
+  return count;
+}
+
+void testUpstreamSync() {
+  static ShoppingStore kitchen;
+  static ShoppingStore garage;
+  MemoryLog kitchenLog;
+  MemoryLog garageLog;
+  initShoppingStore(kitchen, 1, &kitchenLog);
+  initShoppingStore(garage, 2, &garageLog);
+  StandInUpstream upstream;
+  uint32_t phone = replicaHash("phone");
+  uint32_t tablet = replicaHash("tablet");
+
+  // Edits pile up on both hubs while the upstream is unreachable
+  upstream.online = false;
+  char id[16];
+  for (int i = 0; i < 25; i++) {
+    snprintf(id, sizeof(id), "k%d", i);
+    applyShoppingChange(kitchen, id, "kitchen", false, false, 1000 + i, phone, false);
+    snprintf(id, sizeof(id), "g%d", i);
+    applyShoppingChange(garage, id, "garage", false, false, 1000 + i, tablet, false);
+  }
+  // Both hubs edit the same item; the later edit must win everywhere
+  applyShoppingChange(kitchen, "k0", "kitchen", true, false, 5000, phone, false);
+  applyShoppingChange(garage, "k0", "kitchen", false, true, 6000, tablet, false);
+  CHECK_EQ(syncHub(kitchen, "kitchen", upstream), -1);
+  CHECK_EQ(syncHub(garage, "garage", upstream), -1);
+  // Nothing was marked as sent while the upstream was down
+  CHECK_EQ(kitchen.upstreamSentSeq, 0);
+  CHECK_EQ(garage.upstreamSentSeq, 0);
+
+  upstream.online = true;
+  int rounds = 0;
+  for (; rounds < 20; rounds++) {
+    int pushed = syncHub(kitchen, "kitchen", upstream) + syncHub(garage, "garage", upstream);
+    if (pushed == 0 && visibleItems(kitchen) == visibleItems(garage)) {
+      break;
+    }
+  }
+  CHECK(rounds < 20);
+  CHECK(upstream.largestBatch <= (size_t)batchSize);
+  // Each hub's items pushed once (the garage also edited k0): what came
+  // from the upstream is never pushed back to it
+  CHECK_EQ(upstream.changesReceived, 25 + 26);
+  CHECK(visibleItems(kitchen) == visibleItems(upstream.store));
+  CHECK(visibleItems(garage) == visibleItems(upstream.store));
+  CHECK(findShoppingItem(kitchen, "k0")->deleted);
+  CHECK_EQ(visibleItems(kitchen).size(), 49);
+
+  // Once in step, a round carries no changes either way
+  CHECK_EQ(syncHub(kitchen, "kitchen", upstream), 0);
+  CHECK_EQ(upstream.changesReceived, 25 + 26);
+}
+
+int main() {
+  testMerge();
+  testReplayAndCompaction();
+  testFailedWrites();
+  testUpstreamSync();
+  return checkFailures();
+}